@@ -0,0 +1,375 @@
+/*
+ * Adaptive Merge Sort
+ * Copyright 2017 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * Benchmark driver for the merge-sort algorithm
+ *
+ * Usage: bench [n_items] [n_reps]
+ *
+ * Times mergesort() against qsort(), qsort_r() and g_qsort_with_data() for
+ * element sizes of 4 and 8 bytes (which take the specialized word-sized code
+ * paths), 12, 16, 24, 32, 64 and 128 bytes (which take the fixed-size copy
+ * paths), and 256 bytes (which are sorted indirectly).  Each element starts
+ * with a 32-bit key; the rest is payload.  The column "MERGESORT_DEFINE" is a
+ * sort generated for each element type by that macro, with the comparison
+ * inlined.  "mergesort_parallel" uses one thread per online CPU, and
+ * "mergesort_by_key" sorts by the key as MERGESORT_KEY_I32.  The median time
+ * in milliseconds over n_reps repetitions is reported.
+ *
+ * A second table reports, for mergesort(), the peak temporary storage in
+ * bytes, the number of (re)allocations, and the number of page faults (from
+ * getrusage) per sort.  Temporary storage is tracked by passing
+ * bench_allocator to mergesort_with_allocator().
+ */
+
+#define _GNU_SOURCE  /* for qsort_r */
+
+#include "mergesort.h"
+#include "mergesort_define.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <glib.h>
+
+static const int sizes[] = {4, 8, 12, 16, 24, 32, 64, 128, 256};
+
+typedef enum {
+    DIST_RANDOM,
+    DIST_SORTED,
+    DIST_REVERSED,
+    DIST_SWAPS,
+    DIST_FEW_UNIQUE,
+    N_DISTS
+} Dist;
+
+static const char * const dist_names[N_DISTS] = {
+    "random", "sorted", "reversed", "1%-swaps", "few-unique"
+};
+
+typedef enum {
+    SORT_MERGESORT,
+    SORT_QSORT,
+    SORT_QSORT_R,
+    SORT_G_QSORT,
+    SORT_DEFINE,
+    SORT_PARALLEL,
+    SORT_BY_KEY,
+    N_SORTS
+} Sort;
+
+static const char * const sort_names[N_SORTS] = {
+    "mergesort", "qsort", "qsort_r", "g_qsort_with_data", "MERGESORT_DEFINE",
+    "mergesort_parallel", "mergesort_by_key"
+};
+
+/* type-specialized sorts for each element size */
+#define DEFINE_SORT(bytes) \
+    typedef struct { int32_t key; char payload[bytes - 4]; } Elem##bytes; \
+    MERGESORT_DEFINE (sort_elem##bytes, Elem##bytes, a->key < b->key)
+
+MERGESORT_DEFINE (sort_elem4, int32_t, * a < * b)
+DEFINE_SORT (8)
+DEFINE_SORT (12)
+DEFINE_SORT (16)
+DEFINE_SORT (24)
+DEFINE_SORT (32)
+DEFINE_SORT (64)
+DEFINE_SORT (128)
+DEFINE_SORT (256)
+
+static void sort_specialized (void * items, int n_items, int size)
+{
+    switch (size)
+    {
+    case 4: sort_elem4 (items, n_items); break;
+    case 8: sort_elem8 (items, n_items); break;
+    case 12: sort_elem12 (items, n_items); break;
+    case 16: sort_elem16 (items, n_items); break;
+    case 24: sort_elem24 (items, n_items); break;
+    case 32: sort_elem32 (items, n_items); break;
+    case 64: sort_elem64 (items, n_items); break;
+    case 128: sort_elem128 (items, n_items); break;
+    case 256: sort_elem256 (items, n_items); break;
+    default: abort ();
+    }
+}
+
+static void * gen_array (int n_items, int size, Dist dist)
+{
+    char * items = g_malloc0 ((size_t) n_items * size);
+
+    for (int i = 0; i < n_items; i ++)
+    {
+        int32_t key;
+
+        switch (dist)
+        {
+        case DIST_RANDOM:
+            key = g_random_int_range (0, n_items);
+            break;
+        case DIST_REVERSED:
+            key = n_items - 1 - i;
+            break;
+        case DIST_FEW_UNIQUE:
+            key = g_random_int_range (0, 16);
+            break;
+        default:
+            key = i;
+            break;
+        }
+
+        memcpy (items + (size_t) i * size, & key, sizeof key);
+    }
+
+    /* introduce randomness by swapping pairs of keys */
+    if (dist == DIST_SWAPS)
+    {
+        for (int i = 0; i < n_items / 100; i ++)
+        {
+            int32_t * a = (int32_t *) (items + (size_t) g_random_int_range (0, n_items) * size);
+            int32_t * b = (int32_t *) (items + (size_t) g_random_int_range (0, n_items) * size);
+
+            int32_t temp = * a;
+            * a = * b;
+            * b = temp;
+        }
+    }
+
+    return items;
+}
+
+static int compare_keys (const void * a, const void * b, void * data)
+{
+    int32_t a_key = * (const int32_t *) a;
+    int32_t b_key = * (const int32_t *) b;
+
+    return (a_key > b_key) - (a_key < b_key);
+}
+
+static int compare_keys_qsort (const void * a, const void * b)
+{
+    return compare_keys (a, b, NULL);
+}
+
+static void verify_sorted (const void * items_, int n_items, int size, Sort sort)
+{
+    const char * items = items_;
+
+    for (int i = 0; i < n_items - 1; i ++)
+    {
+        if (compare_keys (items + (size_t) i * size, items + (size_t) (i + 1) * size, NULL) > 0)
+        {
+            fprintf (stderr, "%s failed to sort %d-byte elements\n", sort_names[sort], size);
+            abort ();
+        }
+    }
+}
+
+/* Allocator callbacks for mergesort_with_allocator().  A header in front of
+ * each block records its size so that the current total can be tracked. */
+
+#define HEADER_SIZE 16
+
+static size_t mem_current, mem_peak;
+static int mem_count;
+
+static void * bench_realloc (void * ptr, size_t size, void * context)
+{
+    char * block = ptr ? (char *) ptr - HEADER_SIZE : NULL;
+
+    if (block)
+        mem_current -= * (size_t *) block;
+
+    block = g_realloc (block, HEADER_SIZE + size);
+    * (size_t *) block = size;
+
+    mem_current += size;
+    if (mem_peak < mem_current)
+        mem_peak = mem_current;
+
+    mem_count ++;
+
+    return block + HEADER_SIZE;
+}
+
+static void bench_free (void * ptr, void * context)
+{
+    char * block = (char *) ptr - HEADER_SIZE;
+    mem_current -= * (size_t *) block;
+    g_free (block);
+}
+
+static const MergeSortAllocator bench_allocator = {
+    bench_realloc, bench_free, NULL
+};
+
+static long page_faults (void)
+{
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, & usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+static double now_ms (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, & ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int compare_doubles (const void * a_, const void * b_)
+{
+    double a = * (const double *) a_;
+    double b = * (const double *) b_;
+
+    return (a > b) - (a < b);
+}
+
+static double measure (const void * input, int n_items, int size, Sort sort,
+                       int n_reps)
+{
+    size_t bytes = (size_t) n_items * size;
+    void * items = g_malloc (bytes);
+    double * times = g_new (double, n_reps);
+
+    for (int rep = 0; rep < n_reps; rep ++)
+    {
+        memcpy (items, input, bytes);
+
+        double start = now_ms ();
+
+        switch (sort)
+        {
+        case SORT_MERGESORT:
+            mergesort (items, n_items, size, compare_keys, NULL);
+            break;
+        case SORT_QSORT:
+            qsort (items, n_items, size, compare_keys_qsort);
+            break;
+        case SORT_QSORT_R:
+            qsort_r (items, n_items, size, compare_keys, NULL);
+            break;
+        case SORT_G_QSORT:
+            g_qsort_with_data (items, n_items, size, compare_keys, NULL);
+            break;
+        case SORT_DEFINE:
+            sort_specialized (items, n_items, size);
+            break;
+        case SORT_PARALLEL:
+            mergesort_parallel (items, n_items, size, compare_keys, NULL, 0);
+            break;
+        default:
+            mergesort_by_key (items, n_items, size, 0, MERGESORT_KEY_I32, 0);
+            break;
+        }
+
+        times[rep] = now_ms () - start;
+        verify_sorted (items, n_items, size, sort);
+    }
+
+    qsort (times, n_reps, sizeof (double), compare_doubles);
+    double median = (n_reps % 2) ? times[n_reps / 2]
+                  : (times[n_reps / 2 - 1] + times[n_reps / 2]) / 2;
+
+    g_free (times);
+    g_free (items);
+
+    return median;
+}
+
+static void measure_memory (const void * input, int n_items, int size)
+{
+    size_t bytes = (size_t) n_items * size;
+    void * items = g_malloc (bytes);
+
+    memcpy (items, input, bytes);
+
+    mem_current = mem_peak = 0;
+    mem_count = 0;
+    long faults = page_faults ();
+
+    mergesort_with_allocator (items, n_items, size, compare_keys, NULL,
+                              & bench_allocator);
+
+    faults = page_faults () - faults;
+    verify_sorted (items, n_items, size, SORT_MERGESORT);
+
+    printf ("\t%zu\t%d\t%ld\n", mem_peak, mem_count, faults);
+
+    g_free (items);
+}
+
+int main (int argc, char * * argv)
+{
+    int n_items = (argc > 1) ? atoi (argv[1]) : 1000000;
+    int n_reps = (argc > 2) ? atoi (argv[2]) : 5;
+
+    if (n_items < 1 || n_reps < 1)
+    {
+        fprintf (stderr, "Usage: bench [n_items] [n_reps]\n");
+        return 1;
+    }
+
+    g_random_set_seed (0);
+
+    printf ("size\tdist");
+    for (int s = 0; s < N_SORTS; s ++)
+        printf ("\t%s", sort_names[s]);
+    printf ("\n");
+
+    for (int i = 0; i < (int) G_N_ELEMENTS (sizes); i ++)
+    {
+        for (int d = 0; d < N_DISTS; d ++)
+        {
+            void * input = gen_array (n_items, sizes[i], d);
+
+            printf ("%d\t%s", sizes[i], dist_names[d]);
+
+            for (int s = 0; s < N_SORTS; s ++)
+                printf ("\t%.3f", measure (input, n_items, sizes[i], s, n_reps));
+
+            printf ("\n");
+            fflush (stdout);
+
+            g_free (input);
+        }
+    }
+
+    printf ("\nsize\tdist\tpeak_bytes\tallocations\tpage_faults\n");
+
+    for (int i = 0; i < (int) G_N_ELEMENTS (sizes); i ++)
+    {
+        for (int d = 0; d < N_DISTS; d ++)
+        {
+            void * input = gen_array (n_items, sizes[i], d);
+
+            printf ("%d\t%s", sizes[i], dist_names[d]);
+            measure_memory (input, n_items, sizes[i]);
+            fflush (stdout);
+
+            g_free (input);
+        }
+    }
+
+    return 0;
+}
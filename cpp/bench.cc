@@ -1,83 +1,1394 @@
-// Taken from:
-// https://github.com/adrian17/cpp-drop-merge-sort/blob/master/benchmark.cpp
-#include <vector>
-#include <iostream>
-#include <algorithm>
-#include <chrono>
-#include <random>
+/*
+ * Adaptive Merge Sort
+ * Copyright 2017-2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * Benchmark driver for the merge-sort algorithm
+ *
+ * Usage: bench [options]
+ *
+ *   --sizes LIST        element counts, e.g. "10,1000,1e6" (default 100000)
+ *   --types LIST        element types (default int)
+ *   --dists LIST        input distributions (default all)
+ *   --sorts LIST        algorithms to compare (default all)
+ *   --reps N            repetitions per case (default 5)
+ *   --percentiles LIST  percentiles to report besides the median (default 10,90)
+ *   --seed N            seed for the input generator (default 1)
+ *   --format FMT        table, csv or json (default table)
+ *   --mode MODE         what to measure (default time):
+ *
+ *     time     wall-clock time per sort
+ *     count    comparisons and element moves per element, counted by wrapping
+ *              the comparator and the element type in shims; these numbers
+ *              do not depend on the machine
+ *     perf     hardware counters per element (cycles, instructions, branch
+ *              misses, last-level cache misses) via perf_event_open, plus
+ *              time; for mergesort these are attributed to the phases
+ *              reported by MERGESORT_PHASE (run detection, merging,
+ *              allocation).  Where perf events are unavailable (not Linux,
+ *              or disallowed by perf_event_paranoid or a container), only
+ *              time is reported.  Note that every phase change costs a
+ *              system call, which inflates the numbers for inputs with many
+ *              short runs.  This mode is only available in bench-perf
+ *              ("make bench-perf"), the build with the phase markers.
+ *     memory   peak scratch memory in bytes, number of allocations and page
+ *              faults (from getrusage) per sort.  Scratch memory is tracked
+ *              by counting the global operator new while the sort runs, so
+ *              mergesort is measured with its own choice of temporary
+ *              storage (storage on the stack for short lists is not
+ *              counted).
+ *     latency  per-call latency in nanoseconds, for small sorts where call
+ *              overhead dominates.  Every repetition is timed individually
+ *              (minus the measured overhead of reading the clock), cycling
+ *              through 64 different inputs so that the branch predictor
+ *              cannot learn a single one.  In this mode the defaults are
+ *              --sizes 2,4,8,16,32,64 --reps 100000 --percentiles 99.
+ *
+ *   --baseline FILE     compare against results saved earlier with
+ *                       "--format json" and exit with status 2 if any case
+ *                       regressed (see below)
+ *   --threshold PCT     regression threshold in percent (default 5)
+ *   --noise K           noise allowance in standard deviations (default 2)
+ *
+ * With --baseline, each result is matched with the baseline entry of the same
+ * type, distribution, size, algorithm and metric.  It counts as a regression
+ * if its median exceeds the baseline median by more than PCT percent *and* by
+ * more than K times the larger of the two standard deviations, so that noisy
+ * timings are not flagged.  Counts from "--mode count" have no noise, so for
+ * them only the percentage applies.  Cases missing from the baseline are
+ * reported but do not fail.  baseline.json holds comparison and move counts,
+ * peak scratch memory and allocations for mergesort; "make regress" checks
+ * against it.
+ *
+ * Element types: int, int64, string, pair, struct64, struct256.  All types are
+ * compared by a single integer key, so equal keys exercise stability.
+ *
+ * Distributions take an optional parameter after a colon, for example
+ * "zipf:1.2" or "k-sorted:100":
+ *
+ *   random               uniformly random keys
+ *   sorted               already sorted
+ *   reversed             sorted in descending order
+ *   random-fraction:F    sorted, with a fraction F replaced by random keys
+ *   sawtooth:T           T ascending "teeth" of equal length
+ *   organ-pipe           ascending first half, descending second half
+ *   k-sorted:K           every element within K places of its final position
+ *   few-unique:U         only U distinct keys
+ *   appended-tail:F      sorted, followed by a random tail of fraction F
+ *   descending-runs:L    ascending sequence of descending runs of length L
+ *   zipf:S               Zipf-distributed keys with exponent S
+ *
+ * The input generator is self-contained (it does not use the <random>
+ * distributions, whose output differs between standard libraries), so a given
+ * seed produces the same input everywhere.
+ */
+
+/* Phase markers for "--mode perf", which must precede mergesort.h.  They
+ * are compiled in only for bench-perf (-DBENCH_PERF, see the Makefile), so
+ * that the other modes measure the sort without them. */
+enum class Phase { scan, merge, alloc, count };
+static void perf_phase (Phase phase);
+#ifdef BENCH_PERF
+#define MERGESORT_PHASE(phase) perf_phase (Phase::phase)
+#endif
 
 #include "mergesort.h"
 #include "timsort.h"
 
-using namespace std::chrono;
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <errno.h>
+#include <map>
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* Element types                                                            */
+/* ------------------------------------------------------------------------ */
+
+typedef std::pair<uint32_t, uint32_t> Pair;
 
-static float rng_uniform(float a, float b)
+template<int Size>
+struct Record
 {
-    static std::mt19937 gen(1);
-    return std::uniform_real_distribution<float>(a, b)(gen);
+    uint64_t key;
+    unsigned char payload[Size - sizeof (uint64_t)];
+};
+
+static uint64_t key_of (int32_t item) { return item; }
+static uint64_t key_of (int64_t item) { return item; }
+static const std::string & key_of (const std::string & item) { return item; }
+static uint32_t key_of (const Pair & item) { return item.first; }
+template<int Size>
+static uint64_t key_of (const Record<Size> & item) { return item.key; }
+
+/* all benchmarks compare by key only, so that stability matters */
+struct KeyLess
+{
+    template<typename T>
+    bool operator() (const T & a, const T & b) const
+        { return key_of (a) < key_of (b); }
+};
+
+static void make_item (int32_t & item, uint64_t key, size_t) { item = key; }
+static void make_item (int64_t & item, uint64_t key, size_t) { item = key; }
+static void make_item (Pair & item, uint64_t key, size_t idx)
+    { item = Pair (key, idx); }
+
+static void make_item (std::string & item, uint64_t key, size_t)
+{
+    /* long enough to defeat the small-string optimization */
+    char buf[32];
+    snprintf (buf, sizeof buf, "%020llu", (unsigned long long) key);
+    item = buf;
 }
 
+template<int Size>
+static void make_item (Record<Size> & item, uint64_t key, size_t idx)
+{
+    item.key = key;
+    memset (item.payload, (unsigned char) idx, sizeof item.payload);
+}
+
+/* Counting shims for "--mode count".  Every construction or assignment of a
+ * Counted<T> from another element counts as one move, and every call through
+ * CountingLess as one comparison. */
+
+static uint64_t n_compares, n_moves;
+
 template<typename T>
-std::vector<T> randomize(float factor) {
-    int max = 1000000;
-    std::vector<T> ret(max);
-    for (int i = 0; i < max; ++i) {
-        if (rng_uniform(0.0, 1.0) < factor)
-            ret[i] = rng_uniform(0, max-1);
-        else
-            ret[i] = i;
-    }
-    return ret;
-}
-template<>
-std::vector<std::string> randomize<std::string>(float factor) {
-    int max = 100000;
-    std::vector<std::string> ret(max);
-    for (int i = 0; i < max; ++i) {
-        std::string s;
-        if (rng_uniform(0.0, 1.0) < factor)
-            s = std::to_string(rng_uniform(0, max-1));
-        else
-            s = std::to_string(i);
-        ret[i] = std::string(100 - s.size(), '0') + s;
+struct Counted
+{
+    T value;
+
+    Counted () = default;
+
+    Counted (const Counted & b) : value (b.value)
+        { n_moves ++; }
+    Counted (Counted && b) : value (std::move (b.value))
+        { n_moves ++; }
+
+    Counted & operator= (const Counted & b)
+        { value = b.value; n_moves ++; return * this; }
+    Counted & operator= (Counted && b)
+        { value = std::move (b.value); n_moves ++; return * this; }
+};
+
+template<typename T>
+static auto key_of (const Counted<T> & item) -> decltype (key_of (item.value))
+    { return key_of (item.value); }
+
+template<typename T>
+static void make_item (Counted<T> & item, uint64_t key, size_t idx)
+    { make_item (item.value, key, idx); }
+
+struct CountingLess
+{
+    template<typename T>
+    bool operator() (const T & a, const T & b) const
+        { n_compares ++; return KeyLess () (a, b); }
+};
+
+/* ------------------------------------------------------------------------ */
+/* Hardware counters                                                        */
+/* ------------------------------------------------------------------------ */
+
+static const char * const phase_names[] = {"scan", "merge", "alloc"};
+
+static const struct {
+    const char * name;
+#ifdef __linux__
+    uint32_t type;
+    uint64_t config;
+#endif
+} event_table[] = {
+#ifdef __linux__
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"llc_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+     (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+#endif
+    {"time_ns"}
+};
+
+static const int n_events = sizeof event_table / sizeof event_table[0];
+static const int n_phases = (int) Phase::count;
+
+/* The counters are read at every phase change and the difference is added
+ * to the phase just finished.  Only events that could be opened are read;
+ * time_ns (always the last event) comes from the system clock. */
+static struct {
+    bool active;
+    int group_fd = -1;
+    bool opened[n_events];
+    Phase phase;
+    uint64_t last[n_events];
+    uint64_t totals[n_phases][n_events];
+} perf;
+
+static void perf_open ()
+{
+#ifdef __linux__
+    for (int e = 0; e < n_events - 1; e ++)
+    {
+        struct perf_event_attr attr;
+        memset (& attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = event_table[e].type;
+        attr.config = event_table[e].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        int fd = syscall (SYS_perf_event_open, & attr, 0, -1, perf.group_fd, 0);
+
+        if (fd < 0)
+        {
+            fprintf (stderr, "bench: %s counter unavailable: %s\n",
+                     event_table[e].name, strerror (errno));
+
+            /* without a group leader, nothing else can be counted */
+            if (perf.group_fd < 0)
+                break;
+
+            continue;
+        }
+
+        if (perf.group_fd < 0)
+            perf.group_fd = fd;
+
+        perf.opened[e] = true;
     }
-    return ret;
+#endif
+
+    perf.opened[n_events - 1] = true;
+}
+
+static void perf_read (uint64_t * values)
+{
+#ifdef __linux__
+    if (perf.group_fd >= 0)
+    {
+        uint64_t buf[1 + n_events];
+
+        if (read (perf.group_fd, buf, sizeof buf) > 0)
+        {
+            /* values come back in the order the events were opened */
+            for (int e = 0, i = 1; e < n_events - 1; e ++)
+            {
+                if (perf.opened[e])
+                    values[e] = buf[i ++];
+            }
+        }
+    }
+#endif
+
+    values[n_events - 1] = std::chrono::duration_cast<std::chrono::nanoseconds>
+     (std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+static void perf_phase (Phase phase)
+{
+    if (! perf.active || phase == perf.phase)
+        return;
+
+    uint64_t values[n_events] = {};
+    perf_read (values);
+
+    for (int e = 0; e < n_events; e ++)
+        perf.totals[(int) perf.phase][e] += values[e] - perf.last[e];
+
+    memcpy (perf.last, values, sizeof values);
+    perf.phase = phase;
+}
+
+static void perf_start ()
+{
+    memset (perf.totals, 0, sizeof perf.totals);
+    perf.phase = Phase::scan;
+    perf_read (perf.last);
+    perf.active = true;
+}
+
+static void perf_stop ()
+{
+    /* attribute the final stretch to its phase */
+    perf_phase (Phase::count);
+    perf.active = false;
 }
 
-template<typename T, typename Sort>
-float measure(float factor, Sort sort) {
-    size_t total = 0;
-    constexpr size_t sz = 5;
-    for (int i = 0; i < (int)sz; ++i) {
-        auto tab = randomize<T>(factor);
-        //auto copy = tab;
-        auto t1 = high_resolution_clock::now();
-        sort(tab);
-        auto t2 = high_resolution_clock::now();
-        size_t time = duration_cast<microseconds>(t2-t1).count();
-        total += time;
+/* ------------------------------------------------------------------------ */
+/* Input distributions                                                      */
+/* ------------------------------------------------------------------------ */
+
+/* splitmix64 */
+struct Random
+{
+    uint64_t state;
+
+    explicit Random (uint64_t seed) : state (seed) {}
+
+    uint64_t next ()
+    {
+        uint64_t z = (state += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+
+    /* uniform in [0, n) */
+    uint64_t below (uint64_t n)
+        { return (uint64_t) (((unsigned __int128) next () * n) >> 64); }
+
+    /* uniform in [0, 1) */
+    double uniform ()
+        { return (next () >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+/*
+ * Zipf distribution over the ranks 1..n with exponent s, using the
+ * rejection-inversion method of Hoermann and Derflinger, which needs neither
+ * a table nor more than a couple of random numbers per sample.
+ */
+class Zipf
+{
+public:
+    Zipf (uint64_t n, double s) :
+        n (n), s (s),
+        h_x1 (h_integral (1.5) - 1.0),
+        h_n (h_integral (n + 0.5)),
+        threshold (2.0 - h_integral_inverse (h_integral (2.5) - h (2.0))) {}
+
+    uint64_t sample (Random & rng) const
+    {
+        while (1)
+        {
+            double u = h_n + rng.uniform () * (h_x1 - h_n);
+            double x = h_integral_inverse (u);
+            double k = std::floor (x + 0.5);
+
+            if (k < 1)
+                k = 1;
+            else if (k > n)
+                k = n;
+
+            if (k - x <= threshold || u >= h_integral (k + 0.5) - h (k))
+                return (uint64_t) k;
+        }
+    }
+
+private:
+    /* log1p (x) / x and expm1 (x) / x, accurate near zero */
+    static double helper1 (double x)
+    {
+        if (std::fabs (x) > 1e-8)
+            return std::log1p (x) / x;
+        return 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+    }
+
+    static double helper2 (double x)
+    {
+        if (std::fabs (x) > 1e-8)
+            return std::expm1 (x) / x;
+        return 1.0 + x * 0.5 * (1.0 + x * (1.0 / 3.0) * (1.0 + 0.25 * x));
+    }
+
+    double h (double x) const
+        { return std::exp (-s * std::log (x)); }
+
+    double h_integral (double x) const
+    {
+        double log_x = std::log (x);
+        return helper2 ((1.0 - s) * log_x) * log_x;
+    }
+
+    double h_integral_inverse (double x) const
+    {
+        double t = x * (1.0 - s);
+        if (t < -1.0)
+            t = -1.0;
+        return std::exp (helper1 (t) * x);
+    }
+
+    double n, s;
+    double h_x1, h_n, threshold;
+};
+
+struct Dist
+{
+    std::string name;
+    double param;
+};
+
+static const struct {
+    const char * name;
+    double default_param;
+} dist_table[] = {
+    {"random", 0},
+    {"sorted", 0},
+    {"reversed", 0},
+    {"random-fraction", 0.05},
+    {"sawtooth", 16},
+    {"organ-pipe", 0},
+    {"k-sorted", 64},
+    {"few-unique", 16},
+    {"appended-tail", 0.01},
+    {"descending-runs", 1000},
+    {"zipf", 1.0}
+};
 
-        // sanity check
-        //std::sort(copy.begin(), copy.end());
-        //if(copy != tab)
-        //    throw "asdf";
+static std::string dist_label (const Dist & dist)
+{
+    for (auto & entry : dist_table)
+    {
+        if (dist.name == entry.name && entry.default_param == 0)
+            return dist.name;
     }
-    return total / (1000.0 * sz);
+
+    char buf[32];
+    snprintf (buf, sizeof buf, ":%g", dist.param);
+    return dist.name + buf;
 }
 
+/* fills an array with keys following the given distribution */
 template<typename T>
-void benchmark() {
-    for (int i = 0; i <= 20; ++i) {
-        float factor = i * 0.05;
-        auto dt1 = measure<T>(factor, [](auto &tab){std::stable_sort(std::begin(tab), std::end(tab));});
-        auto dt2 = measure<T>(factor, [](auto &tab){mergesort(std::begin(tab), std::end(tab));});
-        auto dt3 = measure<T>(factor, [](auto &tab){gfx::timsort(std::begin(tab), std::end(tab));});
-        std::cout << (factor) << "\t" << dt1 << "\t" << dt2 << "\t" << dt3 << "\n";
+static void gen_array (std::vector<T> & items, size_t n, const Dist & dist,
+                       uint64_t seed)
+{
+    Random rng (seed);
+    const std::string & name = dist.name;
+    double param = dist.param;
+
+    items.resize (n);
+
+    if (name == "random")
+    {
+        for (size_t i = 0; i < n; i ++)
+            make_item (items[i], rng.below (n), i);
+    }
+    else if (name == "sorted")
+    {
+        for (size_t i = 0; i < n; i ++)
+            make_item (items[i], i, i);
+    }
+    else if (name == "reversed")
+    {
+        for (size_t i = 0; i < n; i ++)
+            make_item (items[i], n - 1 - i, i);
+    }
+    else if (name == "random-fraction")
+    {
+        for (size_t i = 0; i < n; i ++)
+            make_item (items[i], (rng.uniform () < param) ? rng.below (n) : i, i);
+    }
+    else if (name == "sawtooth")
+    {
+        size_t tooth = std::max ((size_t) 1, (size_t) std::ceil (n / std::max (param, 1.0)));
+        for (size_t i = 0; i < n; i ++)
+            make_item (items[i], i % tooth, i);
+    }
+    else if (name == "organ-pipe")
+    {
+        for (size_t i = 0; i < n; i ++)
+            make_item (items[i], (i < n / 2) ? i : n - 1 - i, i);
+    }
+    else if (name == "k-sorted")
+    {
+        /* a key of i + [0, K] keeps each element within K of its final rank */
+        uint64_t k = (uint64_t) param;
+        for (size_t i = 0; i < n; i ++)
+            make_item (items[i], i + rng.below (k + 1), i);
+    }
+    else if (name == "few-unique")
+    {
+        uint64_t unique = std::max ((uint64_t) 1, (uint64_t) param);
+        for (size_t i = 0; i < n; i ++)
+            make_item (items[i], rng.below (unique), i);
+    }
+    else if (name == "appended-tail")
+    {
+        size_t sorted = n - (size_t) (n * param);
+        for (size_t i = 0; i < sorted; i ++)
+            make_item (items[i], i, i);
+        for (size_t i = sorted; i < n; i ++)
+            make_item (items[i], rng.below (n), i);
+    }
+    else if (name == "descending-runs")
+    {
+        size_t len = std::max ((size_t) 1, (size_t) param);
+        for (size_t i = 0; i < n; i ++)
+            make_item (items[i], (i / len) * len + (len - 1 - i % len), i);
+    }
+    else if (name == "zipf")
+    {
+        Zipf zipf (n, param);
+        for (size_t i = 0; i < n; i ++)
+            make_item (items[i], zipf.sample (rng) - 1, i);
     }
-    std::cout << "\n";
 }
 
-int main(){
-    benchmark<int>();
-    benchmark<std::string>();
+/* ------------------------------------------------------------------------ */
+/* Algorithms                                                               */
+/* ------------------------------------------------------------------------ */
+
+static const char * const sort_names[] = {"stable_sort", "mergesort", "timsort"};
+
+/* broken out for profiling */
+template<typename T, typename Less>
+static void run_sort (const std::string & sort, std::vector<T> & items, Less less)
+    __attribute__ ((noinline));
+
+template<typename T, typename Less>
+static void run_sort (const std::string & sort, std::vector<T> & items, Less less)
+{
+    if (sort == "stable_sort")
+        std::stable_sort (items.begin (), items.end (), less);
+    else if (sort == "mergesort")
+        mergesort (items.begin (), items.end (), less);
+    else if (sort == "timsort")
+        gfx::timsort (items.begin (), items.end (), less);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Memory tracking                                                          */
+/* ------------------------------------------------------------------------ */
+
+static struct {
+    bool tracking;
+    size_t current, peak, count;
+} heap;
+
+static void heap_count_alloc (size_t bytes)
+{
+    heap.current += bytes;
+    heap.peak = std::max (heap.peak, heap.current);
+    heap.count ++;
+}
+
+/* Replacements for the global operator new and delete, which every algorithm
+ * allocates through (std::allocator uses them).  A header records the size of
+ * each block so that it can be subtracted again when freed. */
+static const size_t heap_header = alignof (std::max_align_t);
+
+/* noinline keeps GCC from pairing the malloc/free inside with new/delete
+ * at the call sites and warning about a mismatch */
+void * operator new (size_t bytes) __attribute__ ((noinline));
+void operator delete (void * ptr) noexcept __attribute__ ((noinline));
+
+void * operator new (size_t bytes)
+{
+    char * block = (char *) malloc (heap_header + bytes);
+    if (! block)
+        throw std::bad_alloc ();
+
+    * (size_t *) block = bytes;
+
+    if (heap.tracking)
+        heap_count_alloc (bytes);
+
+    return block + heap_header;
+}
+
+void operator delete (void * ptr) noexcept
+{
+    if (! ptr)
+        return;
+
+    char * block = (char *) ptr - heap_header;
+
+    if (heap.tracking)
+        heap.current -= * (size_t *) block;
+
+    free (block);
+}
+
+void operator delete (void * ptr, size_t) noexcept
+    { operator delete (ptr); }
+
+static long page_faults ()
+{
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, & usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Statistics and output                                                    */
+/* ------------------------------------------------------------------------ */
+
+struct Config
+{
+    std::vector<size_t> sizes {100000};
+    std::vector<std::string> types {"int"};
+    std::vector<Dist> dists;
+    std::vector<std::string> sorts;
+    std::vector<double> percentiles {10, 90};
+    int reps = 5;
+    uint64_t seed = 1;
+    std::string format = "table";
+    std::string mode = "time";
+    std::string baseline;
+    double threshold = 5;
+    double noise = 2;
+};
+
+struct Stats
+{
+    double mean, stddev, min, median, max;
+    std::vector<double> percentiles;
+};
+
+struct Result
+{
+    std::string type, dist, sort, metric;
+    size_t n;
+    int reps;
+    Stats stats;
+};
+
+/* linear interpolation between the closest ranks */
+static double percentile (const std::vector<double> & sorted, double p)
+{
+    double pos = (p / 100) * (sorted.size () - 1);
+    size_t lo = (size_t) pos;
+    if (lo + 1 >= sorted.size ())
+        return sorted.back ();
+
+    return sorted[lo] + (pos - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+static Stats summarize (std::vector<double> samples, const Config & config)
+{
+    Stats stats;
+    std::sort (samples.begin (), samples.end ());
+
+    double sum = 0, sum_sq = 0;
+    for (double x : samples)
+        sum += x;
+
+    stats.mean = sum / samples.size ();
+
+    for (double x : samples)
+        sum_sq += (x - stats.mean) * (x - stats.mean);
+
+    /* sample (n - 1) standard deviation */
+    stats.stddev = (samples.size () > 1) ? std::sqrt (sum_sq / (samples.size () - 1)) : 0;
+    stats.min = samples.front ();
+    stats.median = percentile (samples, 50);
+    stats.max = samples.back ();
+
+    for (double p : config.percentiles)
+        stats.percentiles.push_back (percentile (samples, p));
+
+    return stats;
+}
+
+static void print_header (const Config & config)
+{
+    if (config.format == "csv")
+    {
+        printf ("type,dist,n,sort,metric,reps,mean,stddev,min,median,max");
+        for (double p : config.percentiles)
+            printf (",p%g", p);
+        printf ("\n");
+    }
+    else if (config.format == "json")
+        printf ("{\n  \"results\": [");
+    else
+    {
+        printf ("%-10s %-20s %10s %-12s %-19s %9s %9s %9s %9s",
+                "type", "dist", "n", "sort", "metric", "mean", "stddev", "min", "median");
+        for (double p : config.percentiles)
+        {
+            char label[16];
+            snprintf (label, sizeof label, "p%g", p);
+            printf (" %9s", label);
+        }
+        printf (" %9s\n", "max");
+    }
+}
+
+static void print_result (const Result & r, const Config & config)
+{
+    static bool first = true;
+    const Stats & s = r.stats;
+
+    if (config.format == "csv")
+    {
+        printf ("%s,%s,%zu,%s,%s,%d,%g,%g,%g,%g,%g", r.type.c_str (),
+                r.dist.c_str (), r.n, r.sort.c_str (), r.metric.c_str (),
+                r.reps, s.mean, s.stddev, s.min, s.median, s.max);
+        for (double v : s.percentiles)
+            printf (",%g", v);
+        printf ("\n");
+    }
+    else if (config.format == "json")
+    {
+        printf ("%s\n    {\"type\": \"%s\", \"dist\": \"%s\", \"n\": %zu, "
+                "\"sort\": \"%s\", \"metric\": \"%s\", \"reps\": %d, "
+                "\"mean\": %.9g, \"stddev\": %.9g, \"min\": %.9g, "
+                "\"median\": %.9g, \"max\": %.9g", first ? "" : ",",
+                r.type.c_str (), r.dist.c_str (), r.n, r.sort.c_str (),
+                r.metric.c_str (), r.reps, s.mean, s.stddev, s.min, s.median,
+                s.max);
+        for (size_t i = 0; i < s.percentiles.size (); i ++)
+            printf (", \"p%g\": %.9g", config.percentiles[i], s.percentiles[i]);
+        printf ("}");
+    }
+    else
+    {
+        printf ("%-10s %-20s %10zu %-12s %-19s %9.4g %9.3g %9.4g %9.4g",
+                r.type.c_str (), r.dist.c_str (), r.n, r.sort.c_str (),
+                r.metric.c_str (), s.mean, s.stddev, s.min, s.median);
+        for (double v : s.percentiles)
+            printf (" %9.4g", v);
+        printf (" %9.4g\n", s.max);
+    }
+
+    first = false;
+    fflush (stdout);
+}
+
+static void print_footer (const Config & config)
+{
+    if (config.format == "json")
+        printf ("\n  ]\n}\n");
+}
+
+/* ------------------------------------------------------------------------ */
+/* Regression gate                                                          */
+/* ------------------------------------------------------------------------ */
+
+struct BaselineEntry
+{
+    double median, stddev;
+};
+
+static std::map<std::string, BaselineEntry> baseline;
+static int n_checked, n_regressions, n_missing;
+
+static std::string result_key (const std::string & type, const std::string & dist,
+                               size_t n, const std::string & sort,
+                               const std::string & metric)
+{
+    return type + "/" + dist + "/" + std::to_string (n) + "/" + sort + "/" + metric;
+}
+
+/* Reads the output of "--format json".  This is not a general JSON parser;
+ * it only understands the flat objects inside the "results" array. */
+static void load_baseline (const char * filename)
+{
+    FILE * file = fopen (filename, "r");
+    if (! file)
+    {
+        fprintf (stderr, "bench: cannot open %s: %s\n", filename, strerror (errno));
+        exit (1);
+    }
+
+    std::string text;
+    char buf[4096];
+    size_t len;
+
+    while ((len = fread (buf, 1, sizeof buf, file)) > 0)
+        text.append (buf, len);
+
+    fclose (file);
+
+    size_t pos = text.find ("\"results\"");
+    pos = (pos == std::string::npos) ? pos : text.find ('[', pos);
+
+    if (pos == std::string::npos)
+    {
+        fprintf (stderr, "bench: %s: no results array\n", filename);
+        exit (1);
+    }
+
+    while ((pos = text.find_first_of ("{]", pos)) != std::string::npos && text[pos] == '{')
+    {
+        size_t end = text.find ('}', pos);
+        if (end == std::string::npos)
+            break;
+
+        std::map<std::string, std::string> fields;
+        size_t field = pos + 1;
+
+        /* "name": value pairs, where value is a string or a number */
+        while ((field = text.find ('"', field)) < end)
+        {
+            size_t name_end = text.find ('"', field + 1);
+            size_t colon = text.find (':', name_end);
+            size_t val = text.find_first_not_of (" \t\r\n", colon + 1);
+            size_t val_end;
+
+            if (text[val] == '"')
+            {
+                val_end = text.find ('"', val + 1);
+                fields[text.substr (field + 1, name_end - field - 1)] =
+                 text.substr (val + 1, val_end - val - 1);
+                val_end ++;
+            }
+            else
+            {
+                val_end = text.find_first_of (",}", val);
+                fields[text.substr (field + 1, name_end - field - 1)] =
+                 text.substr (val, val_end - val);
+            }
+
+            field = val_end;
+        }
+
+        std::string key = result_key (fields["type"], fields["dist"],
+         strtoull (fields["n"].c_str (), nullptr, 10), fields["sort"], fields["metric"]);
+
+        baseline[key] = {strtod (fields["median"].c_str (), nullptr),
+                         strtod (fields["stddev"].c_str (), nullptr)};
+
+        pos = end + 1;
+    }
+
+    if (baseline.empty ())
+    {
+        fprintf (stderr, "bench: %s: no results found\n", filename);
+        exit (1);
+    }
+}
+
+static void check_baseline (const Result & r, const Config & config)
+{
+    std::string key = result_key (r.type, r.dist, r.n, r.sort, r.metric);
+    auto it = baseline.find (key);
+
+    if (it == baseline.end ())
+    {
+        fprintf (stderr, "not in baseline: %s\n", key.c_str ());
+        n_missing ++;
+        return;
+    }
+
+    const BaselineEntry & base = it->second;
+    double diff = r.stats.median - base.median;
+    double noise = config.noise * std::max (base.stddev, r.stats.stddev);
+
+    n_checked ++;
+
+    if (diff > base.median * config.threshold / 100 && diff > noise)
+    {
+        fprintf (stderr, "REGRESSION: %s: %g -> %g (%+.1f%%)\n", key.c_str (),
+                 base.median, r.stats.median, 100 * diff / base.median);
+        n_regressions ++;
+    }
+}
+
+static int baseline_summary ()
+{
+    fprintf (stderr, "%d cases checked against baseline, %d regressed, "
+             "%d not in baseline\n", n_checked, n_regressions, n_missing);
+
+    return n_regressions ? 2 : 0;
+}
+
+static void report (const Result & r, const Config & config)
+{
+    print_result (r, config);
+
+    if (! config.baseline.empty ())
+        check_baseline (r, config);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Driver                                                                   */
+/* ------------------------------------------------------------------------ */
+
+/* identifies the case being measured */
+struct Case
+{
+    const char * type;
+    std::string dist;
+    size_t n;
+    const std::string & sort;
+    const Dist & spec;
+};
+
+template<typename T>
+static void check_sorted (const std::vector<T> & items, const Case & c)
+{
+    if (! std::is_sorted (items.begin (), items.end (), KeyLess ()))
+    {
+        fprintf (stderr, "%s failed to sort %s/%s/%zu\n", c.sort.c_str (),
+                 c.type, c.dist.c_str (), c.n);
+        exit (1);
+    }
+}
+
+template<typename T>
+static void measure_time (const std::vector<T> & input, const Case & c,
+                          const Config & config)
+{
+    std::vector<T> items;
+    std::vector<double> times;
+
+    for (int rep = 0; rep < config.reps; rep ++)
+    {
+        items = input;
+
+        auto t1 = std::chrono::steady_clock::now ();
+        run_sort (c.sort, items, KeyLess ());
+        auto t2 = std::chrono::steady_clock::now ();
+
+        check_sorted (items, c);
+        times.push_back (std::chrono::duration<double, std::milli> (t2 - t1).count ());
+    }
+
+    report ({c.type, c.dist, c.sort, "time_ms", c.n, config.reps,
+                   summarize (times, config)}, config);
+}
+
+/* the counts are deterministic, so a single repetition suffices */
+template<typename T>
+static void measure_counts (const std::vector<T> & input, const Case & c,
+                            const Config & config)
+{
+    std::vector<T> items = input;
+
+    n_compares = n_moves = 0;
+    run_sort (c.sort, items, CountingLess ());
+
+    double compares = (double) n_compares / c.n;
+    double moves = (double) n_moves / c.n;
+
+    check_sorted (items, c);
+
+    report ({c.type, c.dist, c.sort, "compares_per_elem", c.n, 1,
+                   summarize ({compares}, config)}, config);
+    report ({c.type, c.dist, c.sort, "moves_per_elem", c.n, 1,
+                   summarize ({moves}, config)}, config);
+}
+
+/* per-element counters for each phase, plus the total over all phases */
+template<typename T>
+static void measure_perf (const std::vector<T> & input, const Case & c,
+                          const Config & config)
+{
+    std::vector<T> items;
+    std::vector<double> samples[n_phases + 1][n_events];
+
+    for (int rep = 0; rep < config.reps; rep ++)
+    {
+        items = input;
+
+        perf_start ();
+        run_sort (c.sort, items, KeyLess ());
+        perf_stop ();
+
+        check_sorted (items, c);
+
+        for (int e = 0; e < n_events; e ++)
+        {
+            uint64_t total = 0;
+
+            for (int p = 0; p < n_phases; p ++)
+            {
+                samples[p][e].push_back ((double) perf.totals[p][e] / c.n);
+                total += perf.totals[p][e];
+            }
+
+            samples[n_phases][e].push_back ((double) total / c.n);
+        }
+    }
+
+    /* only mergesort reports its phases */
+    int first_phase = (c.sort == "mergesort") ? 0 : n_phases;
+
+    for (int p = first_phase; p <= n_phases; p ++)
+    {
+        for (int e = 0; e < n_events; e ++)
+        {
+            if (! perf.opened[e])
+                continue;
+
+            std::string metric = (p < n_phases) ? phase_names[p] : "total";
+            metric = metric + "/" + event_table[e].name;
+
+            report ({c.type, c.dist, c.sort, metric, c.n, config.reps,
+                           summarize (samples[p][e], config)}, config);
+        }
+    }
+}
+
+template<typename T>
+static void measure_memory (const std::vector<T> & input, const Case & c,
+                            const Config & config)
+{
+    std::vector<T> items;
+    std::vector<double> peaks, counts, faults;
+
+    for (int rep = 0; rep < config.reps; rep ++)
+    {
+        items = input;
+
+        heap.current = heap.peak = heap.count = 0;
+        long faults_before = page_faults ();
+
+        heap.tracking = true;
+        run_sort (c.sort, items, KeyLess ());
+        heap.tracking = false;
+
+        faults.push_back (page_faults () - faults_before);
+        peaks.push_back (heap.peak);
+        counts.push_back (heap.count);
+
+        check_sorted (items, c);
+    }
+
+    report ({c.type, c.dist, c.sort, "peak_scratch_bytes", c.n, config.reps,
+             summarize (peaks, config)}, config);
+    report ({c.type, c.dist, c.sort, "allocations", c.n, config.reps,
+             summarize (counts, config)}, config);
+    report ({c.type, c.dist, c.sort, "page_faults", c.n, config.reps,
+             summarize (faults, config)}, config);
+}
+
+/* the clock's own overhead, as the median of many empty intervals */
+static double clock_overhead_ns ()
+{
+    static double overhead = -1;
+
+    if (overhead < 0)
+    {
+        std::vector<double> samples;
+
+        for (int i = 0; i < 10001; i ++)
+        {
+            auto t1 = std::chrono::steady_clock::now ();
+            auto t2 = std::chrono::steady_clock::now ();
+            samples.push_back (std::chrono::duration<double, std::nano> (t2 - t1).count ());
+        }
+
+        std::nth_element (samples.begin (), samples.begin () + 5000, samples.end ());
+        overhead = samples[5000];
+    }
+
+    return overhead;
+}
+
+template<typename T>
+static void measure_latency (const std::vector<T> &, const Case & c,
+                             const Config & config)
+{
+    const int n_inputs = 64;
+    std::vector<std::vector<T>> inputs (n_inputs);
+
+    for (int i = 0; i < n_inputs; i ++)
+        gen_array (inputs[i], c.n, c.spec, config.seed + i);
+
+    /* allocated up front, so that copying an input does not allocate */
+    std::vector<T> items = inputs[0];
+    std::vector<double> times;
+    double overhead = clock_overhead_ns ();
+
+    for (int rep = 0; rep < config.reps; rep ++)
+    {
+        const std::vector<T> & input = inputs[rep % n_inputs];
+        std::copy (input.begin (), input.end (), items.begin ());
+
+        auto t1 = std::chrono::steady_clock::now ();
+        run_sort (c.sort, items, KeyLess ());
+        auto t2 = std::chrono::steady_clock::now ();
+
+        times.push_back (std::chrono::duration<double, std::nano> (t2 - t1).count () - overhead);
+    }
+
+    check_sorted (items, c);
+
+    report ({c.type, c.dist, c.sort, "latency_ns", c.n, config.reps,
+             summarize (times, config)}, config);
+}
+
+template<typename T>
+static void bench_cases (const char * type, const Config & config,
+                         void (* measure) (const std::vector<T> & input,
+                                           const Case & c, const Config & config))
+{
+    for (const Dist & dist : config.dists)
+    {
+        for (size_t n : config.sizes)
+        {
+            std::vector<T> input;
+
+            try
+                { gen_array (input, n, dist, config.seed); }
+            catch (const std::bad_alloc &)
+            {
+                fprintf (stderr, "Skipping %s/%s/%zu: out of memory\n", type,
+                         dist_label (dist).c_str (), n);
+                continue;
+            }
+
+            for (const std::string & sort : config.sorts)
+            {
+                try
+                    { measure (input, {type, dist_label (dist), n, sort, dist}, config); }
+                catch (const std::bad_alloc &)
+                {
+                    fprintf (stderr, "Skipping %s/%s/%zu/%s: out of memory\n",
+                             type, dist_label (dist).c_str (), n, sort.c_str ());
+                }
+            }
+        }
+    }
+}
+
+template<typename T>
+static void bench_type (const char * type, const Config & config)
+{
+    if (config.mode == "count")
+        bench_cases<Counted<T>> (type, config, measure_counts<Counted<T>>);
+    else if (config.mode == "perf")
+        bench_cases<T> (type, config, measure_perf<T>);
+    else if (config.mode == "memory")
+        bench_cases<T> (type, config, measure_memory<T>);
+    else if (config.mode == "latency")
+        bench_cases<T> (type, config, measure_latency<T>);
+    else
+        bench_cases<T> (type, config, measure_time<T>);
+}
+
+static const struct {
+    const char * name;
+    void (* run) (const char * type, const Config & config);
+} type_table[] = {
+    {"int", bench_type<int32_t>},
+    {"int64", bench_type<int64_t>},
+    {"string", bench_type<std::string>},
+    {"pair", bench_type<Pair>},
+    {"struct64", bench_type<Record<64>>},
+    {"struct256", bench_type<Record<256>>}
+};
+
+static void usage (const char * msg)
+{
+    fprintf (stderr, "bench: %s\n"
+             "Usage: bench [--sizes LIST] [--types LIST] [--dists LIST] [--sorts LIST]\n"
+             "             [--reps N] [--percentiles LIST] [--seed N]\n"
+             "             [--format table|csv|json] [--mode time|count|perf|memory|latency]\n"
+             "             [--baseline FILE] [--threshold PCT] [--noise K]\n", msg);
+    exit (1);
+}
+
+static std::vector<std::string> split (const char * list)
+{
+    std::vector<std::string> items;
+    std::string s (list);
+    size_t pos = 0, comma;
+
+    while ((comma = s.find (',', pos)) != std::string::npos)
+    {
+        items.push_back (s.substr (pos, comma - pos));
+        pos = comma + 1;
+    }
+
+    items.push_back (s.substr (pos));
+    return items;
+}
+
+static double parse_number (const std::string & s)
+{
+    char * end;
+    double val = strtod (s.c_str (), & end);
+    if (s.empty () || * end)
+        usage (("invalid number: " + s).c_str ());
+
+    return val;
+}
+
+static Dist parse_dist (const std::string & spec)
+{
+    size_t colon = spec.find (':');
+    Dist dist {spec.substr (0, colon), 0};
+
+    for (auto & entry : dist_table)
+    {
+        if (dist.name != entry.name)
+            continue;
+
+        dist.param = (colon == std::string::npos) ? entry.default_param
+                   : parse_number (spec.substr (colon + 1));
+        return dist;
+    }
+
+    usage (("unknown distribution: " + dist.name).c_str ());
+    return dist;
+}
+
+static Config parse_args (int argc, char * * argv)
+{
+    Config config;
+    std::vector<std::string> seen;
+
+    for (int i = 1; i < argc; i ++)
+    {
+        std::string opt = argv[i];
+        if (i + 1 >= argc)
+            usage (("missing value for " + opt).c_str ());
+
+        const char * val = argv[++ i];
+        seen.push_back (opt);
+
+        if (opt == "--sizes")
+        {
+            config.sizes.clear ();
+            for (auto & s : split (val))
+            {
+                double n = parse_number (s);
+                if (n < 1 || n != std::floor (n))
+                    usage (("invalid size: " + s).c_str ());
+                config.sizes.push_back ((size_t) n);
+            }
+        }
+        else if (opt == "--types")
+            config.types = split (val);
+        else if (opt == "--dists")
+        {
+            for (auto & s : split (val))
+                config.dists.push_back (parse_dist (s));
+        }
+        else if (opt == "--sorts")
+            config.sorts = split (val);
+        else if (opt == "--reps")
+            config.reps = atoi (val);
+        else if (opt == "--percentiles")
+        {
+            config.percentiles.clear ();
+            for (auto & s : split (val))
+                config.percentiles.push_back (parse_number (s));
+        }
+        else if (opt == "--seed")
+            config.seed = strtoull (val, nullptr, 0);
+        else if (opt == "--format")
+            config.format = val;
+        else if (opt == "--mode")
+            config.mode = val;
+        else if (opt == "--baseline")
+            config.baseline = val;
+        else if (opt == "--threshold")
+            config.threshold = parse_number (val);
+        else if (opt == "--noise")
+            config.noise = parse_number (val);
+        else
+            usage (("unknown option: " + opt).c_str ());
+    }
+
+    auto given = [& seen] (const char * opt)
+        { return std::find (seen.begin (), seen.end (), opt) != seen.end (); };
+
+    if (config.mode == "latency")
+    {
+        if (! given ("--sizes"))
+            config.sizes = {2, 4, 8, 16, 32, 64};
+        if (! given ("--reps"))
+            config.reps = 100000;
+        if (! given ("--percentiles"))
+            config.percentiles = {99};
+    }
+
+    if (config.dists.empty ())
+    {
+        for (auto & entry : dist_table)
+            config.dists.push_back ({entry.name, entry.default_param});
+    }
+
+    if (config.sorts.empty ())
+        config.sorts.assign (std::begin (sort_names), std::end (sort_names));
+
+    for (auto & sort : config.sorts)
+    {
+        if (std::find (std::begin (sort_names), std::end (sort_names), sort) == std::end (sort_names))
+            usage (("unknown sort: " + sort).c_str ());
+    }
+
+    for (auto & type : config.types)
+    {
+        auto match = [& type] (decltype (type_table[0]) & entry)
+            { return type == entry.name; };
+
+        if (std::find_if (std::begin (type_table), std::end (type_table), match) == std::end (type_table))
+            usage (("unknown type: " + type).c_str ());
+    }
+
+    if (config.reps < 1)
+        usage ("--reps must be at least 1");
+
+    if (config.format != "table" && config.format != "csv" && config.format != "json")
+        usage (("unknown format: " + config.format).c_str ());
+
+    if (config.mode != "time" && config.mode != "count" && config.mode != "perf" &&
+        config.mode != "memory" && config.mode != "latency")
+        usage (("unknown mode: " + config.mode).c_str ());
+
+#ifndef BENCH_PERF
+    if (config.mode == "perf")
+        usage ("--mode perf needs the phase markers: use bench-perf");
+#endif
+
+    if (config.mode == "perf")
+        perf_open ();
+
+    if (! config.baseline.empty ())
+        load_baseline (config.baseline.c_str ());
+
+    return config;
+}
+
+int main (int argc, char * * argv)
+{
+    Config config = parse_args (argc, argv);
+
+    print_header (config);
+
+    for (auto & type : config.types)
+    {
+        for (auto & entry : type_table)
+        {
+            if (type == entry.name)
+                entry.run (entry.name, config);
+        }
+    }
+
+    print_footer (config);
+
+    if (! config.baseline.empty ())
+        return baseline_summary ();
+
+    return 0;
 }
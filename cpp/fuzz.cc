@@ -0,0 +1,311 @@
+/*
+ * Adaptive Merge Sort
+ * Copyright 2017-2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * libFuzzer target for the C and C++ merge-sort algorithms
+ *
+ * Build with "make fuzz" (requires clang) and run e.g. "./fuzz -max_len=65536
+ * corpus/".  The input is decoded as:
+ *
+ *   byte 0     element size, as an index into elem_sizes[]
+ *   byte 1     key length in bytes (1 to the element size); elements are
+ *              ordered by memcmp() of their leading key bytes, so short keys
+ *              produce many duplicates
+ *   byte 2     key type for mergesort_by_key(): bits 0-3 index into
+ *              by_key_types[], bit 4 selects descending order, and bit 5
+ *              replaces some floating-point keys by NaNs, infinities and zeros
+ *   byte 3     key offset for mergesort_by_key(), modulo the room left
+ *   byte 4     scratch size for mergesort_with_buffer(), in 255ths of
+ *              mergesort_scratch_size() (0 merges entirely in place)
+ *   byte 5     thread count for mergesort_parallel(), modulo 8, plus 1
+ *   remainder  the elements themselves
+ *
+ * The array is sorted by the C mergesort(), mergesort_with_buffer() and
+ * mergesort_parallel(), the C++ mergesort() and std::stable_sort(), and all
+ * the results must be byte-for-byte identical.  Since the non-key bytes of
+ * elements with equal keys generally differ, this checks stability as well as
+ * ordering.  mergesort() of both versions must also stay within a budget of
+ * comparisons (see compare_budget()).  Finally, the array is sorted by
+ * mergesort_by_key() (which takes the radix-sort path for 256 or more items)
+ * and compared with std::stable_sort() by the same key.
+ */
+
+#include "../mergesort.h"
+#include "mergesort.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/* covers the word-sized, fixed-size and indirect paths of the C version, and
+ * several sizes taking the generic path */
+static const int elem_sizes[] = {1, 2, 3, 4, 5, 8, 12, 16, 24, 32, 64, 256};
+
+static int key_len;
+static long long n_compares;
+
+static int compare_keys (const void * a, const void * b, void * context)
+{
+    (* (long long *) context) ++;
+    return memcmp (a, b, key_len);
+}
+
+/* the same without counting, since it may be called from several threads */
+static int compare_keys_uncounted (const void * a, const void * b, void * context)
+{
+    return memcmp (a, b, key_len);
+}
+
+template<int Size>
+struct Elem
+{
+    unsigned char bytes[Size];
+
+    bool operator< (const Elem & b) const
+        { return memcmp (bytes, b.bytes, key_len) < 0; }
+};
+
+/* adaptive sorts must not pay for it on unlucky input */
+static long long compare_budget (int n_items)
+{
+    return (n_items < 2) ? 0 : (long long) (2 * n_items * log2 (n_items)) + n_items;
+}
+
+template<int Size>
+static void sort_cxx (unsigned char * data, int n_items)
+{
+    Elem<Size> * items = (Elem<Size> *) data;
+
+    auto less = [] (const Elem<Size> & a, const Elem<Size> & b)
+        { n_compares ++; return a < b; };
+
+    mergesort (items, items + n_items, less);
+}
+
+static void sort_cxx (unsigned char * data, int n_items, int size)
+{
+    switch (size)
+    {
+        case 1: sort_cxx<1> (data, n_items); break;
+        case 2: sort_cxx<2> (data, n_items); break;
+        case 3: sort_cxx<3> (data, n_items); break;
+        case 4: sort_cxx<4> (data, n_items); break;
+        case 5: sort_cxx<5> (data, n_items); break;
+        case 8: sort_cxx<8> (data, n_items); break;
+        case 12: sort_cxx<12> (data, n_items); break;
+        case 16: sort_cxx<16> (data, n_items); break;
+        case 24: sort_cxx<24> (data, n_items); break;
+        case 32: sort_cxx<32> (data, n_items); break;
+        case 64: sort_cxx<64> (data, n_items); break;
+        case 256: sort_cxx<256> (data, n_items); break;
+        default: abort ();
+    }
+}
+
+/* reference result: std::stable_sort of the element indices */
+template<typename Less>
+static std::vector<unsigned char> sort_reference (const unsigned char * data,
+                                                  int n_items, int size, Less less)
+{
+    std::vector<int> order (n_items);
+    for (int i = 0; i < n_items; i ++)
+        order[i] = i;
+
+    std::stable_sort (order.begin (), order.end (), [data, size, less] (int a, int b)
+        { return less (data + a * size, data + b * size); });
+
+    std::vector<unsigned char> sorted (n_items * size);
+    for (int i = 0; i < n_items; i ++)
+        memcpy (& sorted[i * size], data + order[i] * size, size);
+
+    return sorted;
+}
+
+static const int by_key_types[] = {
+    MERGESORT_KEY_U32, MERGESORT_KEY_I32, MERGESORT_KEY_U64, MERGESORT_KEY_I64,
+    MERGESORT_KEY_F32, MERGESORT_KEY_F64, MERGESORT_KEY_BYTES (1),
+    MERGESORT_KEY_BYTES (3), MERGESORT_KEY_BYTES (8)
+};
+
+template<typename T>
+static int compare_as (const unsigned char * a, const unsigned char * b)
+{
+    T x, y;
+    memcpy (& x, a, sizeof x);
+    memcpy (& y, b, sizeof y);
+    return (x > y) - (x < y);
+}
+
+/* floating-point keys as raw bits, ordered as by IEEE 754 totalOrder: by
+ * sign, then by magnitude (larger magnitudes first if negative) */
+template<typename Bits>
+static int compare_total (const unsigned char * a, const unsigned char * b)
+{
+    const Bits sign = (Bits) 1 << (8 * sizeof (Bits) - 1);
+    Bits x, y;
+
+    memcpy (& x, a, sizeof x);
+    memcpy (& y, b, sizeof y);
+
+    if ((x & sign) != (y & sign))
+        return (x & sign) ? -1 : 1;
+
+    int diff = ((x & ~ sign) > (y & ~ sign)) - ((x & ~ sign) < (y & ~ sign));
+    return (x & sign) ? -diff : diff;
+}
+
+/* the order of mergesort_by_key() (ascending), for the reference */
+static int compare_by_key (const unsigned char * a, const unsigned char * b, int type)
+{
+    switch (type)
+    {
+    case MERGESORT_KEY_U32: return compare_as<uint32_t> (a, b);
+    case MERGESORT_KEY_I32: return compare_as<int32_t> (a, b);
+    case MERGESORT_KEY_U64: return compare_as<uint64_t> (a, b);
+    case MERGESORT_KEY_I64: return compare_as<int64_t> (a, b);
+    case MERGESORT_KEY_F32: return compare_total<uint32_t> (a, b);
+    case MERGESORT_KEY_F64: return compare_total<uint64_t> (a, b);
+    default: return memcmp (a, b, type - MERGESORT_KEY_BYTES (0));
+    }
+}
+
+/* NaNs (with and without payload), infinities and zeros of both signs */
+static const uint32_t special_f32[] = {
+    0x7fc00000, 0xffc00000, 0x7f800001, 0x7f800000, 0xff800000, 0x00000000, 0x80000000
+};
+
+static const uint64_t special_f64[] = {
+    UINT64_C (0x7ff8000000000000), UINT64_C (0xfff8000000000000),
+    UINT64_C (0x7ff0000000000001), UINT64_C (0x7ff0000000000000),
+    UINT64_C (0xfff0000000000000), UINT64_C (0x0000000000000000),
+    UINT64_C (0x8000000000000000)
+};
+
+/* mergesort_by_key() against std::stable_sort() by the same key */
+static void check_by_key (const unsigned char * data, int n_items, int size,
+                          uint8_t type_byte, uint8_t offset_byte)
+{
+    int type = by_key_types[(type_byte & 0xf) % (sizeof by_key_types / sizeof by_key_types[0])];
+    bool descending = type_byte & 0x10;
+    bool specials = type_byte & 0x20;
+
+    int width;
+    switch (type)
+    {
+    case MERGESORT_KEY_U32: case MERGESORT_KEY_I32: case MERGESORT_KEY_F32: width = 4; break;
+    case MERGESORT_KEY_U64: case MERGESORT_KEY_I64: case MERGESORT_KEY_F64: width = 8; break;
+    default: width = type - MERGESORT_KEY_BYTES (0); break;
+    }
+
+    if (width > size)
+        return;
+
+    int offset = offset_byte % (size - width + 1);
+    std::vector<unsigned char> items (data, data + n_items * size);
+
+    /* replace about a third of the keys */
+    if (specials && (type == MERGESORT_KEY_F32 || type == MERGESORT_KEY_F64))
+    {
+        for (int i = 0; i < n_items; i ++)
+        {
+            unsigned char * key = & items[i * size + offset];
+
+            if (key[0] % 3)
+                continue;
+
+            if (type == MERGESORT_KEY_F32)
+                memcpy (key, & special_f32[key[1] % 7], 4);
+            else
+                memcpy (key, & special_f64[key[1] % 7], 8);
+        }
+    }
+
+    std::vector<unsigned char> expected = sort_reference (items.data (), n_items, size,
+     [type, descending, offset] (const unsigned char * a, const unsigned char * b)
+    {
+        int diff = compare_by_key (a + offset, b + offset, type);
+        return descending ? diff > 0 : diff < 0;
+    });
+
+    mergesort_by_key (items.data (), n_items, size, offset, type, descending);
+
+    if (items != expected)
+        abort ();
+}
+
+extern "C" int LLVMFuzzerTestOneInput (const uint8_t * input, size_t len)
+{
+    if (len < 6)
+        return 0;
+
+    int size = elem_sizes[input[0] % (sizeof elem_sizes / sizeof elem_sizes[0])];
+    key_len = 1 + input[1] % size;
+
+    int n_items = (len - 6) / size;
+    const unsigned char * data = input + 6;
+
+    std::vector<unsigned char> expected = sort_reference (data, n_items, size,
+     [] (const unsigned char * a, const unsigned char * b)
+        { return memcmp (a, b, key_len) < 0; });
+
+    /* C version */
+    std::vector<unsigned char> items (data, data + n_items * size);
+    long long c_compares = 0;
+
+    mergesort (items.data (), n_items, size, compare_keys, & c_compares);
+
+    if (items != expected || c_compares > compare_budget (n_items))
+        abort ();
+
+    /* C version with a scratch buffer, down to none at all (merging in
+     * place costs more comparisons, so there is no budget) */
+    size_t scratch_bytes = mergesort_scratch_size (n_items, size) * input[4] / 255;
+    std::vector<unsigned char> scratch (scratch_bytes);
+
+    items.assign (data, data + n_items * size);
+    mergesort_with_buffer (items.data (), n_items, size, compare_keys_uncounted,
+                           nullptr, scratch.data (), scratch_bytes);
+
+    if (items != expected)
+        abort ();
+
+    /* C version on several threads */
+    items.assign (data, data + n_items * size);
+    mergesort_parallel (items.data (), n_items, size, compare_keys_uncounted,
+                        nullptr, 1 + input[5] % 8);
+
+    if (items != expected)
+        abort ();
+
+    /* C++ version */
+    items.assign (data, data + n_items * size);
+    n_compares = 0;
+
+    sort_cxx (items.data (), n_items, size);
+
+    if (items != expected || n_compares > compare_budget (n_items))
+        abort ();
+
+    check_by_key (data, n_items, size, input[2], input[3]);
+
+    return 0;
+}
@@ -17,13 +17,55 @@
  * the use of this software.
  */
 
-#ifndef MERGESORT_H
-#define MERGESORT_H
+#ifndef MERGESORT_CPP_H
+#define MERGESORT_CPP_H
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+/*
+ * In C++20, the algorithm is constexpr, so that tables can be sorted at compile
+ * time.  Temporary storage then always comes from std::vector (the stack
+ * buffer for short lists is not usable in constant expressions), and the hooks
+ * below are skipped, so they need not be constexpr themselves.
+ */
+#if __cplusplus >= 202002L
+#include <functional>
+#include <ranges>
+#define MERGESORT_CONSTEXPR constexpr
+#define MERGESORT_HOOK(call) do { if (! std::is_constant_evaluated ()) call; } while (0)
+#else
+#define MERGESORT_CONSTEXPR
+#define MERGESORT_HOOK(call) call
+#endif
+
+/*
+ * Hook for profiling tools: the algorithm invokes MERGESORT_PHASE (scan),
+ * MERGESORT_PHASE (merge) and MERGESORT_PHASE (alloc) whenever it enters run
+ * detection (including insertion sort), merging, or allocation of temporary
+ * storage respectively.  By default these compile to nothing.
+ */
+#ifndef MERGESORT_PHASE
+#define MERGESORT_PHASE(phase) ((void) 0)
+#endif
+
+/*
+ * Hook for testing: MERGESORT_STACK (head, div, n_div) is invoked each time a
+ * new run [head, div[n_div - 1]) has been pushed onto the stack of runs, after
+ * any merges needed to restore the invariant.
+ */
+#ifndef MERGESORT_STACK
+#define MERGESORT_STACK(head, div, n_div) ((void) 0)
+#endif
+
 /*
  * This algorithm borrows some ideas from TimSort but is not quite as
  * sophisticated.  Runs are detected, but only in the forward direction, and the
@@ -39,62 +81,565 @@
  *   2. The algorithm requires O(N) temporary storage.  The caller can
  *      override how to allocate this storage via the "copy" template
  *      parameter.
+ *   3. Lists of up to 64 items are sorted by binary insertion, without any
+ *      temporary storage (mergesort_runs() merges them with temporary
+ *      storage on the stack instead).  The limit is 4 KB of items, so for
+ *      items of more than 64 bytes it is lower (and items of more than 4 KB
+ *      always take the general path).
+ *   4. In C++20 the algorithm can be run at compile time (see
+ *      MERGESORT_CONSTEXPR above).
+ *   5. In C++20 there is also a version taking ranges, sentinels and
+ *      projections, adaptive::ranges::mergesort (see the end of this file).
+ *   6. Items of trivially relocatable types (see below) in arrays or vectors
+ *      are moved as raw bytes by the three-argument version.
+ *   7. Parallel arrays can be sorted together by mergesort_zip() below.
+ *   8. adaptive::measure_presortedness() below tells how sorted a list
+ *      already is.
+ */
+
+namespace adaptive {
+
+/*
+ * Trait telling whether an object can be moved to a new address by copying
+ * its bytes, leaving the old copy to be forgotten without running its
+ * destructor.  This holds for all trivially copyable types and, in practice,
+ * for many others such as std::unique_ptr or std::shared_ptr (but not
+ * std::string in libstdc++, which may point into itself).  It may be
+ * specialized for such types:
+ *
+ *   namespace adaptive {
+ *   template<> struct is_trivially_relocatable<MyType> : std::true_type {};
+ *   }
+ *
+ * For these types, the comparison function must not throw: if it does, some
+ * objects may be left duplicated and others lost.
  */
+template<typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+
+namespace detail {
+
+/* True if the iterator is known to point into a contiguous array, so that
+ * ranges of items can be relocated as raw memory */
+template<typename Iter, typename Value = typename std::iterator_traits<Iter>::value_type>
+struct is_contiguous : std::integral_constant<bool,
+    (std::is_pointer<Iter>::value ||
+     std::is_same<Iter, typename std::vector<Value>::iterator>::value) &&
+    std::is_same<typename std::iterator_traits<Iter>::reference, Value &>::value> {};
+
+template<typename Iter>
+struct can_relocate : std::integral_constant<bool,
+    is_trivially_relocatable<typename std::iterator_traits<Iter>::value_type>::value &&
+    is_contiguous<Iter>::value> {};
+
+/* Address of an item as raw memory (the cast also tells the compiler that
+ * copying non-trivial objects as bytes is intended) */
+template<typename Iter>
+void * raw (Iter it)
+    { return static_cast<void *> (std::addressof (* it)); }
+
+/* Element moves used by mergesort(), either by move assignment or by
+ * relocation (std::true_type) */
+
+template<typename Src, typename Dest>
+MERGESORT_CONSTEXPR void move_item (Src src, Dest dest, std::false_type)
+    { * dest = std::move (* src); }
+
+template<typename Src, typename Dest>
+void move_item (Src src, Dest dest, std::true_type)
+    { std::memcpy (raw (dest), raw (src), sizeof (* src)); }
+
+template<typename Src, typename Dest>
+MERGESORT_CONSTEXPR void move_items (Src start, Src end, Dest dest, std::false_type)
+    { std::move (start, end, dest); }
 
-template<typename Iter, typename Less, typename Copy>
-void mergesort (Iter start, Iter end, Less less, Copy copy)
+template<typename Src, typename Dest>
+void move_items (Src start, Src end, Dest dest, std::true_type)
+{
+    if (start < end)
+        std::memmove (raw (dest), raw (start), (end - start) * sizeof (* start));
+}
+
+/* Same as move_items(), but for a destination range ending at dest_end,
+ * which may overlap [start, end) from the right */
+template<typename Src, typename Dest>
+MERGESORT_CONSTEXPR void move_items_backward (Src start, Src end, Dest dest_end,
+                                              std::false_type)
+    { std::move_backward (start, end, dest_end); }
+
+template<typename Src, typename Dest>
+void move_items_backward (Src start, Src end, Dest dest_end, std::true_type)
+    { move_items (start, end, dest_end - (end - start), std::true_type ()); }
+
+/* Exchanges two items, and the adjacent ranges [head, mid) and [mid, tail),
+ * as std::iter_swap() and std::rotate() do */
+template<typename Iter, typename Relocate>
+MERGESORT_CONSTEXPR void swap_items (Iter a, Iter b, Relocate)
+    { std::iter_swap (a, b); }
+
+template<typename Iter, typename Relocate>
+MERGESORT_CONSTEXPR void rotate_items (Iter head, Iter mid, Iter tail, Relocate)
+    { std::rotate (head, mid, tail); }
+
+/* Moves the item at head to dest - 1, shifting [head + 1, dest) left by one */
+template<typename Iter>
+MERGESORT_CONSTEXPR void rotate_left (Iter head, Iter dest, std::false_type)
+{
+    typedef typename std::iterator_traits<Iter>::value_type Value;
+
+    Value tmp = std::move (* head);
+    std::move (head + 1, dest, head);
+    * (dest - 1) = std::move (tmp);
+}
+
+template<typename Iter>
+void rotate_left (Iter head, Iter dest, std::true_type)
 {
     typedef typename std::iterator_traits<Iter>::value_type Value;
 
-    /* One step of an insertion sort: rotates the head item into place
-     * within the sorted sub-list [head + 1, tail) */
-    auto rotate_head = [less] (Iter head, Iter tail)
+    alignas (Value) unsigned char tmp[sizeof (Value)];
+    std::memcpy (tmp, raw (head), sizeof (Value));
+    std::memmove (raw (head), raw (head + 1), (dest - head - 1) * sizeof (Value));
+    std::memcpy (raw (dest - 1), tmp, sizeof (Value));
+}
+
+/* One step of an insertion sort: rotates the head item into place within the
+ * sorted sub-list [head + 1, tail) */
+template<typename Iter, typename Less, typename Relocate>
+MERGESORT_CONSTEXPR void rotate_head (Iter head, Iter tail, Less & less, Relocate)
+{
+    /* Find the proper location for the head item.  Skip *(head+1) since we
+     * already know it is less than *(head). */
+    Iter dest = head + 2;
+    while (dest < tail && less (* dest, * head))
+        dest ++;
+
+    /* equivalent of std::rotate, inlined for speed */
+    rotate_left (head, dest, Relocate ());
+}
+
+/* Extends the sorted run starting at head to the left, as far as the items
+ * are in non-descending order, and returns its new start.  This is the scan
+ * shared by mergesort() and measure_presortedness(). */
+template<typename Iter, typename Less>
+MERGESORT_CONSTEXPR Iter extend_run (Iter start, Iter head, Less & less)
+{
+    while (head > start && ! less (* head, * (head - 1)))
+        head --;
+
+    return head;
+}
+
+/* Run finders for mergesort(): each returns the start of the run ending at
+ * mid.  The default scans for the run (see below); a function object passed
+ * instead is simply called with mid (see mergesort_runs()). */
+struct ScanRuns {};
+
+template<typename Iter, typename Less, typename Relocate>
+MERGESORT_CONSTEXPR Iter find_run (ScanRuns &, Iter start, Iter mid, Less & less, Relocate)
+{
+    /* Scan right-to-left to find a run of increasing values.
+     * If necessary, use insertion sort to create a run at 4 values long.
+     * At this scale, insertion sort is faster due to lower overhead. */
+    Iter head = extend_run (start, mid - 1, less);
+
+    while (head > start && mid - head < 4)
     {
-        /* Find the proper location for the head item.  Skip *(head+1)
-         * since we already know it is less than *(head). */
-        Iter dest = head + 2;
-        while (dest < tail && less (* dest, * head))
-            dest ++;
+        rotate_head (head - 1, mid, less, Relocate ());
+        head = extend_run (start, head - 1, less);
+    }
 
-        /* equivalent of std::rotate, inlined for speed */
-        Value tmp = std::move (* head);
-        std::move (head + 1, dest, head);
-        * (dest - 1) = std::move (tmp);
-    };
+    return head;
+}
+
+template<typename FindRun, typename Iter, typename Less, typename Relocate>
+MERGESORT_CONSTEXPR Iter find_run (FindRun & find, Iter, Iter mid, Less &, Relocate)
+    { return find (mid); }
+
+/* Whether the temporary storage returned by "copy" holds n items: always,
+ * unless it has a member function holds (n) saying otherwise */
+template<typename Buffer>
+MERGESORT_CONSTEXPR auto holds (Buffer & buf, size_t n, int) -> decltype (buf.holds (n))
+    { return buf.holds (n); }
+
+template<typename Buffer>
+MERGESORT_CONSTEXPR bool holds (Buffer &, size_t, long)
+    { return true; }
+
+/* The merge loops take one item at a time, until one list has "won"
+ * gallop_min times in a row */
+constexpr size_t gallop_min = 7;
+
+/* Binary search within a sorted list for the first item that does not sort
+ * before the key: with upper = false the result is the first item not less
+ * than the key (lower bound), with true the first item greater than the key
+ * (upper bound) */
+template<typename Iter, typename Key, typename Less>
+MERGESORT_CONSTEXPR Iter search (Iter start, Iter end, const Key & key,
+                                 bool upper, Less & less)
+{
+    return upper ? std::upper_bound (start, end, key, less)
+                 : std::lower_bound (start, end, key, less);
+}
+
+/* True if item x sorts before the key, in the sense of search() */
+template<typename Item, typename Key, typename Less>
+MERGESORT_CONSTEXPR bool before (const Item & x, const Key & key, bool upper,
+                                 Less & less)
+    { return upper ? ! less (key, x) : less (x, key); }
+
+/* Same as search(), but first probes 1, 2, 4, 8, ... items from the start of
+ * the list, so that the cost is logarithmic in the distance to the result
+ * rather than in the length of the list ("galloping") */
+template<typename Iter, typename Key, typename Less>
+MERGESORT_CONSTEXPR Iter gallop (Iter start, Iter end, const Key & key,
+                                 bool upper, Less & less)
+{
+    auto n = end - start;
+    decltype (n) prev = 0, ofs = 1;
 
-    /* Merges the two sorted sub-lists [head, mid) and [mid, tail) */
-    auto do_merge = [less, copy] (Iter head, Iter mid, Iter tail)
+    /* the first "prev" items sort before the key */
+    while (ofs <= n && before (start[ofs - 1], key, upper, less))
     {
-        /* copy list "a" to temporary storage */
-        auto & buf = copy (head, mid);
+        prev = ofs;
+        ofs *= 2;
+    }
+
+    if (ofs <= n)
+        end = start + (ofs - 1);
+
+    return search (start + prev, end, key, upper, less);
+}
+
+/* Same as gallop(), but probes from the end of the list */
+template<typename Iter, typename Key, typename Less>
+MERGESORT_CONSTEXPR Iter gallop_back (Iter start, Iter end, const Key & key,
+                                      bool upper, Less & less)
+{
+    auto n = end - start;
+    decltype (n) prev = 0, ofs = 1;
 
-        auto a = buf.begin ();
-        auto a_end = a + (mid - head);
-        Iter b = mid;
-        Iter dest = head;
+    /* the last "prev" items do not sort before the key */
+    while (ofs <= n && ! before (end[- ofs], key, upper, less))
+    {
+        prev = ofs;
+        ofs *= 2;
+    }
+
+    if (ofs <= n)
+        start = end - (ofs - 1);
+
+    return search (start, end - prev, key, upper, less);
+}
+
+/* Merges [head, mid) and [mid, tail), with list "a" moved to temporary
+ * storage starting at a, working left-to-right */
+template<typename Iter, typename Temp, typename Less, typename Relocate>
+MERGESORT_CONSTEXPR void merge_lo (Iter head, Iter mid, Iter tail, Temp a,
+                                   Less & less, Relocate)
+{
+    Temp a_end = a + (mid - head);
+    Iter b = mid;
+    Iter dest = head;
+    size_t a_wins, b_wins;
+    size_t min_gallop = gallop_min;
 
-        /* the exit conditions of this loop are separated as an optimization */
-        while (1)
+    while (a < a_end && b < tail)
+    {
+        a_wins = b_wins = 0;
+
+        while (a < a_end && b < tail)
         {
             if (! less (* b, * a))
             {
-                * (dest ++) = std::move (* a);
-                /* we already know b < tail, so don't waste time checking it */
-                if ((++ a) == a_end)
+                move_item (a ++, dest ++, Relocate ());
+                b_wins = 0;
+                if (++ a_wins == min_gallop)
                     break;
             }
             else
             {
-                * (dest ++) = std::move (* b);
-                /* we already know a < a_end, so don't waste time checking it */
-                if ((++ b) == tail)
+                move_item (b ++, dest ++, Relocate ());
+                a_wins = 0;
+                if (++ b_wins == min_gallop)
                     break;
             }
         }
 
-        /* copy remainder of list "a" */
-        std::move (a, a_end, dest);
-    };
+        /* Gallop: while either list keeps winning, move whole blocks found by
+         * exponential search instead of comparing one item at a time. */
+        while (a < a_end && b < tail)
+        {
+            Temp a_stop = gallop (a, a_end, * b, true, less);
+            a_wins = a_stop - a;
+            move_items (a, a_stop, dest, Relocate ());
+            dest += a_stop - a;
+            a = a_stop;
+
+            if (a == a_end)
+                break;
+
+            Iter b_stop = gallop (b, tail, * a, false, less);
+            b_wins = b_stop - b;
+            move_items (b, b_stop, dest, Relocate ());
+            dest += b_stop - b;
+            b = b_stop;
+
+            if (a_wins < gallop_min && b_wins < gallop_min)
+            {
+                /* galloping did not pay off; make it harder to start again */
+                min_gallop ++;
+                break;
+            }
+
+            if (min_gallop > 1)
+                min_gallop --;
+        }
+    }
+
+    /* move remainder of list "a" (any remainder of "b" is already in place) */
+    move_items (a, a_end, dest, Relocate ());
+}
+
+/* Merges [head, mid) and [mid, tail), with list "b" moved to temporary
+ * storage starting at temp, working right-to-left */
+template<typename Iter, typename Temp, typename Less, typename Relocate>
+MERGESORT_CONSTEXPR void merge_hi (Iter head, Iter mid, Iter tail, Temp temp,
+                                   Less & less, Relocate)
+{
+    Iter a = mid;
+    Temp b = temp + (tail - mid);
+    Iter dest = tail;
+    size_t a_wins, b_wins;
+    size_t min_gallop = gallop_min;
+
+    while (a > head && b > temp)
+    {
+        a_wins = b_wins = 0;
+
+        while (a > head && b > temp)
+        {
+            if (less (* (b - 1), * (a - 1)))
+            {
+                move_item (-- a, -- dest, Relocate ());
+                b_wins = 0;
+                if (++ a_wins == min_gallop)
+                    break;
+            }
+            else
+            {
+                move_item (-- b, -- dest, Relocate ());
+                a_wins = 0;
+                if (++ b_wins == min_gallop)
+                    break;
+            }
+        }
+
+        /* gallop, as in merge_lo() */
+        while (a > head && b > temp)
+        {
+            Iter a_stop = gallop_back (head, a, * (b - 1), true, less);
+            a_wins = a - a_stop;
+            move_items_backward (a_stop, a, dest, Relocate ());
+            dest -= a - a_stop;
+            a = a_stop;
+
+            if (a == head)
+                break;
+
+            Temp b_stop = gallop_back (temp, b, * (a - 1), false, less);
+            b_wins = b - b_stop;
+            move_items_backward (b_stop, b, dest, Relocate ());
+            dest -= b - b_stop;
+            b = b_stop;
+
+            if (a_wins < gallop_min && b_wins < gallop_min)
+            {
+                /* galloping did not pay off; make it harder to start again */
+                min_gallop ++;
+                break;
+            }
+
+            if (min_gallop > 1)
+                min_gallop --;
+        }
+    }
+
+    /* move remainder of list "b" (any remainder of "a" is already in place) */
+    move_items (temp, b, head, Relocate ());
+}
+
+/* Exchanges the adjacent ranges [head, mid) and [mid, tail).  The shorter
+ * one is moved through temporary storage if it fits; otherwise they are
+ * exchanged in place. */
+template<typename Iter, typename Copy, typename Relocate>
+MERGESORT_CONSTEXPR void rotate_buffered (Iter head, Iter mid, Iter tail,
+                                          Copy & copy, Relocate)
+{
+    auto n_a = mid - head;
+    auto n_b = tail - mid;
+
+    if (n_a <= n_b)
+    {
+        auto & buf = copy (head, mid);
+
+        if (holds (buf, n_a, 0))
+        {
+            move_items (mid, tail, head, Relocate ());
+            move_items (buf.begin (), buf.begin () + n_a, head + n_b,
+                        Relocate ());
+            return;
+        }
+    }
+    else
+    {
+        auto & buf = copy (mid, tail);
+
+        if (holds (buf, n_b, 0))
+        {
+            move_items_backward (head, mid, tail, Relocate ());
+            move_items (buf.begin (), buf.begin () + n_b, head, Relocate ());
+            return;
+        }
+    }
+
+    rotate_items (head, mid, tail, Relocate ());
+}
+
+template<typename Iter, typename Less, typename Copy, typename Relocate>
+MERGESORT_CONSTEXPR void merge_in_place (Iter head, Iter mid, Iter tail, Less & less,
+                                         Copy & copy, Relocate);
+
+/* Merges the two sorted sub-lists [head, mid) and [mid, tail) */
+template<typename Iter, typename Less, typename Copy, typename Relocate>
+MERGESORT_CONSTEXPR void merge (Iter head, Iter mid, Iter tail, Less & less,
+                                Copy & copy, Relocate)
+{
+    MERGESORT_HOOK (MERGESORT_PHASE (merge));
+
+    /* Trim the items that are already in place: those at the start of list
+     * "a" that are not greater than the first item of "b", and those at the
+     * end of "b" that are not less than the last item of "a". */
+    head = gallop (head, mid, * mid, true, less);
+    if (head == mid)
+        return;
+
+    tail = gallop_back (mid, tail, * (mid - 1), false, less);
+
+    /* Handle the case of strictly separate (but reversed) lists specially.
+     * In this case, we simply exchange the two lists. */
+    if (less (* (tail - 1), * head))
+    {
+        rotate_buffered (head, mid, tail, copy, Relocate ());
+        return;
+    }
+
+    /* move the shorter list to temporary storage */
+    if (mid - head <= tail - mid)
+    {
+        auto & buf = copy (head, mid);
+
+        if (holds (buf, mid - head, 0))
+            merge_lo (head, mid, tail, buf.begin (), less, Relocate ());
+        else
+            merge_in_place (head, mid, tail, less, copy, Relocate ());
+    }
+    else
+    {
+        auto & buf = copy (mid, tail);
+
+        if (holds (buf, tail - mid, 0))
+            merge_hi (head, mid, tail, buf.begin (), less, Relocate ());
+        else
+            merge_in_place (head, mid, tail, less, copy, Relocate ());
+    }
+}
+
+/* Merges two sorted sub-lists when neither fits in temporary storage.  The
+ * longer list is split in half, and the matching split point in the other
+ * list is found by binary search.  Exchanging the middle two blocks leaves two
+ * smaller merges, which are handed back to merge() (so that they use the
+ * temporary storage once they fit in it). */
+template<typename Iter, typename Less, typename Copy, typename Relocate>
+MERGESORT_CONSTEXPR void merge_in_place (Iter head, Iter mid, Iter tail, Less & less,
+                                         Copy & copy, Relocate)
+{
+    auto n_a = mid - head;
+    auto n_b = tail - mid;
+    Iter cut_a, cut_b;
+
+    if (n_a == 1 && n_b == 1)
+    {
+        if (less (* mid, * head))
+            swap_items (head, mid, Relocate ());
+
+        return;
+    }
+
+    /* cut the longer list in half and find the matching cut in the other */
+    if (n_a > n_b)
+    {
+        cut_a = head + n_a / 2;
+        cut_b = search (mid, tail, * cut_a, false, less);
+    }
+    else
+    {
+        cut_b = mid + n_b / 2;
+        cut_a = search (head, mid, * cut_b, true, less);
+    }
+
+    rotate_items (cut_a, mid, cut_b, Relocate ());
+
+    Iter new_mid = cut_a + (cut_b - mid);
+
+    if (head < cut_a && cut_a < new_mid)
+        merge (head, cut_a, new_mid, less, copy, Relocate ());
+    if (new_mid < cut_b && cut_b < tail)
+        merge (new_mid, cut_b, tail, less, copy, Relocate ());
+}
+
+/* Maps a 64-bit random number onto [0, n) as the high half of the 128-bit
+ * product, so that all of its bits count and n may exceed 2^32 */
+inline size_t random_index (uint64_t r, size_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return (uint64_t) (((__uint128_t) r * n) >> 64);
+#else
+    uint64_t r_lo = r & 0xffffffff, r_hi = r >> 32;
+    uint64_t n_lo = (uint64_t) n & 0xffffffff, n_hi = (uint64_t) n >> 32;
+    uint64_t mid = (r_lo * n_lo >> 32) + (r_hi * n_lo & 0xffffffff) +
+                   r_lo * n_hi;
+
+    return r_hi * n_hi + (r_hi * n_lo >> 32) + (mid >> 32);
+#endif
+}
+
+} // namespace detail
+} // namespace adaptive
+
+/*
+ * The "copy" function moves the items [start, end) to temporary storage and
+ * returns that storage (an object with a member function begin ()).  Only
+ * the shorter list of each merge is copied, so it never holds more than half
+ * of the items.  Storage of limited size may also have a member function
+ * holds (n), returning false if n items do not fit; "copy" must then leave
+ * the items where they are, and the merge is done in place (with more
+ * comparisons and moves) instead.
+ *
+ * The "Relocate" parameter is std::true_type if items are to be moved as raw
+ * bytes (see is_trivially_relocatable above), in which case the buffer
+ * returned by "copy" must also hold raw copies of the items, and must not
+ * destroy them.  This is used by the three-argument version below.  The
+ * "FindRun" parameter replaces run detection (see mergesort_runs() below).
+ */
+template<typename Iter, typename Less, typename Copy,
+         typename Relocate = std::false_type,
+         typename FindRun = adaptive::detail::ScanRuns>
+MERGESORT_CONSTEXPR void mergesort (Iter start, Iter end, Less less, Copy copy,
+                                    Relocate = Relocate (), FindRun find_run = FindRun ())
+{
+    auto do_merge = [& less, & copy] (Iter head, Iter mid, Iter tail)
+        { adaptive::detail::merge (head, mid, tail, less, copy, Relocate ()); };
 
     /* A list with 0 or 1 element is sorted by definition. */
     if (end - start < 2)
@@ -111,24 +656,10 @@ void mergesort (Iter start, Iter end, Less less, Copy copy)
 
     do
     {
-        Iter mid = head;
-        head --;
+        MERGESORT_HOOK (MERGESORT_PHASE (scan));
 
-        /* Scan right-to-left to find a run of increasing values.
-         * If necessary, use insertion sort to create a run at 4 values long.
-         * At this scale, insertion sort is faster due to lower overhead. */
-        while (head > start)
-        {
-            if (less (* head, * (head - 1)))
-            {
-                if (mid - head < 4)
-                    rotate_head (head - 1, mid);
-                else
-                    break;
-            }
-
-            head --;
-        }
+        Iter mid = head;
+        head = adaptive::detail::find_run (find_run, start, mid, less, Relocate ());
 
         /* Merge/collapse sub-lists left-to-right to maintain the invariant. */
         while (n_div >= 1)
@@ -202,19 +733,60 @@ void mergesort (Iter start, Iter end, Less less, Copy copy)
         /* push the new sub-list onto the stack */
         div[n_div] = mid;
         n_div ++;
+
+        MERGESORT_HOOK (MERGESORT_STACK (head, div, n_div));
     }
     while (head > start);
 }
 
-template<typename Iter, typename Less>
-void mergesort (Iter start, Iter end, Less less)
+namespace adaptive {
+namespace detail {
+
+/* Fixed-size temporary storage on the stack, used in place of std::vector for
+ * short lists.  Items are move-constructed into the raw storage on first use
+ * and move-assigned afterwards. */
+template<typename Value, int Size>
+class LocalBuffer
 {
-    typedef typename std::iterator_traits<Iter>::value_type Value;
+public:
+    LocalBuffer () = default;
+    LocalBuffer (const LocalBuffer &) = delete;
+    LocalBuffer & operator= (const LocalBuffer &) = delete;
 
-    /* Temporary storage for the algorithm */
-    std::vector<Value> buf;
+    ~LocalBuffer ()
+    {
+        for (int i = 0; i < n_items; i ++)
+            begin ()[i].~Value ();
+    }
+
+    Value * begin ()
+        { return reinterpret_cast<Value *> (storage); }
 
-    auto copy_to_buf = [& buf] (Iter start, Iter end) -> std::vector<Value> &
+    template<typename Iter>
+    void assign (Iter start, Iter end)
+    {
+        int n = end - start;
+        int n_assign = std::min (n, n_items);
+
+        std::move (start, start + n_assign, begin ());
+
+        for (; n_items < n; n_items ++)
+            new (begin () + n_items) Value (std::move (start[n_items]));
+    }
+
+private:
+    alignas (Value) unsigned char storage[Size * sizeof (Value)];
+    int n_items = 0;
+};
+
+/* The "copy" function used with a std::vector as temporary storage */
+template<typename Value>
+struct CopyToVector
+{
+    std::vector<Value> & buf;
+
+    template<typename Iter>
+    MERGESORT_CONSTEXPR std::vector<Value> & operator() (Iter start, Iter end) const
     {
         /* Move items directly onto the existing vector if it's big enough.
          * Otherwise, create a new one; this is significantly faster than
@@ -222,22 +794,561 @@ void mergesort (Iter start, Iter end, Less less)
          * equivalent to size() but avoids a signed/unsigned comparison
          * warning. */
         if (end - start > buf.end () - buf.begin ())
+        {
+            MERGESORT_HOOK (MERGESORT_PHASE (alloc));
             buf = std::vector<Value> (std::make_move_iterator (start),
                                       std::make_move_iterator (end));
+            MERGESORT_HOOK (MERGESORT_PHASE (merge));
+        }
         else
             std::move (start, end, buf.begin ());
 
         return buf;
+    }
+};
+
+/* The number of items sorted with temporary storage on the stack: up to 64,
+ * but no more than fit in 4 KB, so that a few large items cannot overflow a
+ * small thread stack */
+template<typename Value>
+struct local_items : std::integral_constant<int,
+    (sizeof (Value) <= 4096 / 64) ? 64 : (int) (4096 / sizeof (Value))> {};
+
+/* Sorts a short list (see local_items) by binary insertion, with neither
+ * temporary storage nor the stack of runs.  The run at the end of the list is
+ * found first (and reversed, if it is strictly descending), so that a sorted
+ * or reversed list costs one pass; the other items are then inserted into it
+ * right-to-left, each after one comparison with its neighbor if it is already
+ * in place, or else after a binary search. */
+template<typename Iter, typename Less, typename Relocate>
+MERGESORT_CONSTEXPR void insertion_sort (Iter start, Iter end, Less & less,
+                                         Relocate)
+{
+    if (end - start < 2)
+        return;
+
+    Iter head = end - 1;
+
+    if (less (* head, * (head - 1)))
+    {
+        head --;
+        while (head > start && less (* head, * (head - 1)))
+            head --;
+
+        std::reverse (head, end);
+    }
+    else
+        head = extend_run (start, head, less);
+
+    while (head > start)
+    {
+        head --;
+
+        if (! less (* (head + 1), * head))
+            continue;
+
+        /* after any equal items, to keep the sort stable */
+        Iter dest = std::lower_bound (head + 2, end, * head, less);
+        rotate_left (head, dest, Relocate ());
+    }
+}
+
+/* Sorts a short list (see local_items) with temporary storage on the stack
+ * (kept out of mergesort() below, since LocalBuffer is not usable in constexpr
+ * functions) */
+template<typename Iter, typename Less, typename FindRun>
+void mergesort_short (Iter start, Iter end, Less less, FindRun find_run)
+{
+    typedef typename std::iterator_traits<Iter>::value_type Value;
+    /* (at least 1, since this is instantiated even when never called) */
+    typedef LocalBuffer<Value, local_items<Value>::value ? local_items<Value>::value : 1> Local;
+
+    Local local;
+
+    auto copy_to_local = [& local] (Iter start, Iter end) -> Local &
+    {
+        local.assign (start, end);
+        return local;
+    };
+
+    ::mergesort (start, end, less, copy_to_local, std::false_type (), find_run);
+}
+
+/* Uninitialized temporary storage for relocatable items, which are copied in
+ * as raw bytes.  No constructors or destructors are run.  Lists that fit use
+ * the fixed-size storage given to the constructor (if any); longer ones are
+ * allocated. */
+template<typename Value>
+class RawBuffer
+{
+public:
+    RawBuffer (Value * local, size_t local_size) :
+        data (local), size (local_size) {}
+
+    RawBuffer (const RawBuffer &) = delete;
+    RawBuffer & operator= (const RawBuffer &) = delete;
+
+    ~RawBuffer ()
+    {
+        if (allocated)
+            std::allocator<Value> ().deallocate (data, size);
+    }
+
+    Value * begin ()
+        { return data; }
+
+    template<typename Iter>
+    void assign (Iter start, Iter end)
+    {
+        size_t n = end - start;
+
+        if (n > size)
+        {
+            MERGESORT_PHASE (alloc);
+
+            if (allocated)
+                std::allocator<Value> ().deallocate (data, size);
+
+            data = std::allocator<Value> ().allocate (n);
+            size = n;
+            allocated = true;
+
+            MERGESORT_PHASE (merge);
+        }
+
+        std::memcpy (raw (data), raw (start), n * sizeof (Value));
+    }
+
+private:
+    Value * data;
+    size_t size;
+    bool allocated = false;
+};
+
+template<typename Iter, typename Less, typename FindRun, typename Value>
+void mergesort_raw (Iter start, Iter end, Less less, FindRun find_run, RawBuffer<Value> & buf)
+{
+    auto copy_to_buf = [& buf] (Iter start, Iter end) -> RawBuffer<Value> &
+    {
+        buf.assign (start, end);
+        return buf;
     };
 
-    mergesort (start, end, less, copy_to_buf);
+    ::mergesort (start, end, less, copy_to_buf, std::true_type (), find_run);
+}
+
+/* Sorts relocatable items (see adaptive::is_trivially_relocatable), moving
+ * them as raw bytes */
+template<typename Iter, typename Less, typename FindRun>
+void mergesort_relocate (Iter start, Iter end, Less less, FindRun find_run, std::true_type)
+{
+    typedef typename std::iterator_traits<Iter>::value_type Value;
+    constexpr int n_local = local_items<Value>::value;
+
+    /* Short lists: temporary storage on the stack (see local_items) */
+    if (end - start <= n_local)
+    {
+        /* (at least 1 byte, since this is instantiated even for items over
+         * 4 KB) */
+        alignas (Value) unsigned char local[n_local ? n_local * sizeof (Value) : 1];
+        RawBuffer<Value> buf (reinterpret_cast<Value *> (local), n_local);
+
+        mergesort_raw (start, end, less, find_run, buf);
+    }
+    else
+    {
+        RawBuffer<Value> buf (nullptr, 0);
+        mergesort_raw (start, end, less, find_run, buf);
+    }
+}
+
+template<typename Iter, typename Less, typename FindRun>
+void mergesort_relocate (Iter, Iter, Less, FindRun, std::false_type) {}
+
+/* mergesort() with the default choice of temporary storage, for the version
+ * below and mergesort_runs() */
+template<typename Iter, typename Less, typename FindRun>
+MERGESORT_CONSTEXPR void mergesort_buffered (Iter start, Iter end, Less less, FindRun find_run)
+{
+    typedef typename std::iterator_traits<Iter>::value_type Value;
+    typedef can_relocate<Iter> Relocate;
+
+#if __cplusplus >= 202002L
+    bool run_time = ! std::is_constant_evaluated ();
+#else
+    bool run_time = true;
+#endif
+
+    /* Short lists: binary insertion, unless the runs are given */
+    if (end - start <= local_items<Value>::value &&
+        std::is_same<FindRun, ScanRuns>::value)
+    {
+        if (Relocate::value && run_time)
+            insertion_sort (start, end, less, Relocate ());
+        else
+            insertion_sort (start, end, less, std::false_type ());
+
+        return;
+    }
+
+    /* Relocatable items: move them as raw bytes */
+    if (Relocate::value && run_time)
+    {
+        mergesort_relocate (start, end, less, find_run, Relocate ());
+        return;
+    }
+
+    /* Short lists with given runs: avoid the cost of a heap allocation */
+    if (end - start <= local_items<Value>::value && run_time)
+    {
+        mergesort_short (start, end, less, find_run);
+        return;
+    }
+
+    /* Temporary storage for the algorithm */
+    std::vector<Value> buf;
+    CopyToVector<Value> copy_to_buf {buf};
+
+    ::mergesort (start, end, less, copy_to_buf, std::false_type (), find_run);
+}
+
+} // namespace detail
+} // namespace adaptive
+
+template<typename Iter, typename Less>
+MERGESORT_CONSTEXPR void mergesort (Iter start, Iter end, Less less)
+{
+    adaptive::detail::mergesort_buffered (start, end, less, adaptive::detail::ScanRuns ());
 }
 
 template<typename Iter>
-void mergesort (Iter start, Iter end)
+MERGESORT_CONSTEXPR void mergesort (Iter start, Iter end)
 {
     typedef typename std::iterator_traits<Iter>::value_type Value;
     mergesort (start, end, std::less<Value> ());
 }
 
+/*
+ * Same as mergesort(), for a list made of runs that are already sorted (for
+ * example, the concatenated results of several sorts):
+ *
+ *   mergesort_runs (start, end, less, run_boundaries);
+ *
+ * run_boundaries is a container of iterators to the start of each run but
+ * the first, in ascending order; boundaries equal to start or end are
+ * ignored.  The runs are neither scanned nor checked, but merged just as if
+ * the algorithm had found them itself, so this saves a full pass over the
+ * list.
+ */
+template<typename Iter, typename Less, typename Bounds>
+void mergesort_runs (Iter start, Iter end, Less less, const Bounds & run_boundaries)
+{
+    auto first = std::begin (run_boundaries);
+    auto last = std::end (run_boundaries);
+
+    /* The algorithm asks for the runs right-to-left, so walk the boundaries
+     * backwards, skipping any at or beyond mid (which would give an empty
+     * run). */
+    auto find_run = [start, first, & last] (Iter mid) -> Iter
+    {
+        while (last != first && ! (* std::prev (last) < mid))
+            -- last;
+
+        return (last != first && start < * std::prev (last)) ? * std::prev (last) : start;
+    };
+
+    adaptive::detail::mergesort_buffered (start, end, less, find_run);
+}
+
+namespace adaptive {
+
+/* How sorted a list already is, as measured by measure_presortedness() */
+struct Presortedness
+{
+    size_t n_items;
+    size_t n_ascending_runs;   /* maximal non-descending runs */
+    size_t n_descending_runs;  /* maximal strictly descending runs */
+    double run_entropy;        /* -sum (L/N) log2 (L/N) over run lengths L */
+    double inversions;         /* estimated number of pairs out of order */
+};
+
+/*
+ * Measures the presortedness of a list in one pass, without changing it:
+ *
+ *   adaptive::Presortedness p =
+ *    adaptive::measure_presortedness (start, end, less);
+ *
+ * The list is split right-to-left into runs, as mergesort() scans it, except
+ * that strictly descending runs are also recognized (a descending run is one
+ * that mergesort() would have to build item by item).  The run-length entropy
+ * is 0 for a sorted or reversed list and grows to log2 (N) when every run is
+ * short.  The inversion count is exact for lists of up to 45 items (990
+ * pairs); for longer ones it is estimated from 1024 pairs of items chosen at
+ * random (with a fixed seed, so the result is repeatable), costing a further
+ * 1024 comparisons.
+ */
+template<typename Iter, typename Less>
+Presortedness measure_presortedness (Iter start, Iter end, Less less)
+{
+    Presortedness p = {(size_t) (end - start), 0, 0, 0, 0};
+
+    if (p.n_items < 2)
+    {
+        p.n_ascending_runs = p.n_items;
+        return p;
+    }
+
+    double n = p.n_items;
+    Iter mid = end;
+
+    while (mid > start)
+    {
+        Iter head = mid - 1;
+
+        if (head > start && less (* head, * (head - 1)))
+        {
+            while (head > start && less (* head, * (head - 1)))
+                head --;
+
+            p.n_descending_runs ++;
+        }
+        else
+        {
+            head = adaptive::detail::extend_run (start, head, less);
+            p.n_ascending_runs ++;
+        }
+
+        double fraction = (mid - head) / n;
+        p.run_entropy -= fraction * std::log2 (fraction);
+
+        mid = head;
+    }
+
+    double n_pairs = n * (n - 1) / 2;
+    const int n_samples = 1024;
+
+    if (n_pairs <= n_samples)
+    {
+        for (Iter a = start; a < end; a ++)
+        {
+            for (Iter b = a + 1; b < end; b ++)
+                p.inversions += less (* b, * a);
+        }
+    }
+    else
+    {
+        /* 64-bit linear congruential generator (Knuth's MMIX constants) */
+        uint64_t seed = 1;
+        int n_inverted = 0;
+
+        for (int s = 0; s < n_samples; s ++)
+        {
+            size_t i, j;
+
+            do
+            {
+                seed = seed * 6364136223846793005u + 1442695040888963407u;
+                i = adaptive::detail::random_index (seed, p.n_items);
+                seed = seed * 6364136223846793005u + 1442695040888963407u;
+                j = adaptive::detail::random_index (seed, p.n_items);
+            }
+            while (i == j);
+
+            if (i > j)
+                std::swap (i, j);
+
+            n_inverted += less (start[j], start[i]);
+        }
+
+        p.inversions = n_pairs * n_inverted / n_samples;
+    }
+
+    return p;
+}
+
+namespace detail {
+
+/* Moves the items of a column into the order given by the array of indexes,
+ * through a temporary copy of the column */
+template<typename Iter>
+void mergesort_permute (const std::vector<size_t> & order, Iter col)
+{
+    typedef typename std::iterator_traits<Iter>::value_type Value;
+
+    std::vector<Value> scratch;
+    scratch.reserve (order.size ());
+
+    for (size_t i : order)
+        scratch.push_back (std::move (col[i]));
+
+    std::move (scratch.begin (), scratch.end (), col);
+}
+
+} // namespace detail
+} // namespace adaptive
+
+/*
+ * Sorts several parallel arrays ("columns") stably by the first:
+ *
+ *   mergesort_zip (less, keys_start, keys_end, col1_start, col2_start, ...);
+ *
+ * where less compares two keys.  The keys are moved, together with their
+ * original positions, into one temporary array which is sorted, and then
+ * moved back.  Each of the other columns is then moved into the new order
+ * once, through a temporary copy of that column alone; the columns are not
+ * touched during the merges, so the cost of each is linear.  If the keys are
+ * already in order, the other columns are not moved at all.
+ */
+template<typename Less, typename KeyIter, typename ... Iters>
+void mergesort_zip (Less less, KeyIter keys_start, KeyIter keys_end, Iters ... cols)
+{
+    typedef typename std::iterator_traits<KeyIter>::value_type Key;
+    typedef std::pair<Key, size_t> Keyed;
+
+    size_t n_items = keys_end - keys_start;
+    std::vector<Keyed> keyed;
+    keyed.reserve (n_items);
+
+    for (size_t i = 0; i < n_items; i ++)
+        keyed.emplace_back (std::move (keys_start[i]), i);
+
+    auto keyed_less = [less] (const Keyed & a, const Keyed & b)
+        { return less (a.first, b.first); };
+
+    mergesort (keyed.begin (), keyed.end (), keyed_less);
+
+    std::vector<size_t> order (n_items);
+    bool moved = false;
+
+    for (size_t i = 0; i < n_items; i ++)
+    {
+        keys_start[i] = std::move (keyed[i].first);
+        order[i] = keyed[i].second;
+        moved = moved || (order[i] != i);
+    }
+
+    if (! moved)
+        return;
+
+    keyed = std::vector<Keyed> ();
+
+    /* one column at a time (expanded over the parameter pack) */
+    int expand[] = {0, (adaptive::detail::mergesort_permute (order, cols), 0) ...};
+    (void) expand;
+}
+
+#if __cplusplus >= 202002L
+
+namespace adaptive {
+namespace ranges {
+
+/*
+ * Same as std::ranges::stable_sort, but using the algorithm above:
+ *
+ *   adaptive::ranges::mergesort (range, comp, proj);
+ *   adaptive::ranges::mergesort (first, last, comp, proj);
+ *
+ * Any random-access range can be sorted in place, such as a std::span or a
+ * view, and "last" may be a sentinel of a different type than "first".
+ *
+ * If the projection returns a reference (for example, a pointer to a data
+ * member), it is applied at each comparison.  Otherwise it would have to
+ * compute a new key each time, so the keys are instead computed once and
+ * stored in a vector, an array of indexes is sorted by those keys, and the
+ * elements are then moved into the sorted order.  The same is done for
+ * iterators whose reference type is a proxy rather than a true reference.
+ */
+struct mergesort_fn
+{
+    template<std::random_access_iterator Iter, std::sentinel_for<Iter> Sent,
+             typename Comp = std::ranges::less, typename Proj = std::identity>
+        requires std::sortable<Iter, Comp, Proj>
+    constexpr Iter operator() (Iter first, Sent last, Comp comp = {}, Proj proj = {}) const
+    {
+        Iter end = std::ranges::next (first, last);
+
+        if constexpr (std::is_lvalue_reference_v<std::iter_reference_t<Iter>> &&
+                      std::is_lvalue_reference_v<std::indirect_result_t<Proj &, Iter>>)
+        {
+            auto less = [& comp, & proj] (auto & a, auto & b)
+                { return std::invoke (comp, std::invoke (proj, a), std::invoke (proj, b)); };
+
+            ::mergesort (first, end, less);
+        }
+        else
+            sort_by_keys (first, end, comp, proj);
+
+        return end;
+    }
+
+    template<std::ranges::random_access_range Range,
+             typename Comp = std::ranges::less, typename Proj = std::identity>
+        requires std::sortable<std::ranges::iterator_t<Range>, Comp, Proj>
+    constexpr std::ranges::borrowed_iterator_t<Range>
+     operator() (Range && range, Comp comp = {}, Proj proj = {}) const
+    {
+        return (* this) (std::ranges::begin (range), std::ranges::end (range),
+                         std::move (comp), std::move (proj));
+    }
+
+private:
+    template<typename Iter, typename Comp, typename Proj>
+    static constexpr void sort_by_keys (Iter first, Iter end, Comp & comp, Proj & proj)
+    {
+        typedef std::remove_cvref_t<std::indirect_result_t<Proj &, Iter>> Key;
+
+        size_t n_items = end - first;
+
+        /* the keys are only ever constructed, never assigned, so proxy
+         * references (which would assign through) are safe to store */
+        std::vector<Key> keys;
+        std::vector<size_t> order (n_items);
+
+        keys.reserve (n_items);
+
+        for (size_t i = 0; i < n_items; i ++)
+        {
+            keys.emplace_back (std::invoke (proj, first[i]));
+            order[i] = i;
+        }
+
+        auto less = [& comp, & keys] (size_t a, size_t b)
+            { return std::invoke (comp, keys[a], keys[b]); };
+
+        ::mergesort (order.begin (), order.end (), less);
+
+        /* Move the elements into place, following each cycle of the
+         * permutation in turn.  Each element is moved once, plus one extra
+         * move (through temp) per cycle. */
+        for (size_t i = 0; i < n_items; i ++)
+        {
+            if (order[i] == i)
+                continue;
+
+            std::iter_value_t<Iter> temp = std::ranges::iter_move (first + i);
+            size_t j = i;
+
+            while (order[j] != i)
+            {
+                size_t src = order[j];
+
+                first[j] = std::ranges::iter_move (first + src);
+                order[j] = j;  /* mark as done */
+
+                j = src;
+            }
+
+            first[j] = std::move (temp);
+            order[j] = j;
+        }
+    }
+};
+
+inline constexpr mergesort_fn mergesort {};
+
+} // namespace ranges
+} // namespace adaptive
+
+#endif
+
 #endif
@@ -21,10 +21,40 @@
  * Test driver for the merge-sort algorithm
  */
 
+#include <math.h>
+
+/* Checks the invariant each time a run is pushed onto the stack: each run must
+ * be no more than half the length of its right-hand neighbor.  This bounds the
+ * depth of the stack by log2 (N) + 1, well within the fixed 64 entries. */
+static int max_stack_depth;
+
+template<typename Iter>
+void check_stack (Iter head, const Iter * div, int n_div)
+{
+    if (n_div > 64)
+        abort ();
+
+    for (int i = n_div - 1; i > 0; i --)
+    {
+        Iter run_start = (i == n_div - 1) ? head : div[i + 1];
+        if ((div[i] - run_start) > (div[i - 1] - div[i]) / 2)
+            abort ();
+    }
+
+    if (max_stack_depth < n_div)
+        max_stack_depth = n_div;
+}
+
+#define MERGESORT_STACK(head, div, n_div) check_stack (head, div, n_div)
+
 #include "mergesort.h"
 #include "timsort.h"
 
 #include <assert.h>
+#include <iterator>
+#include <memory>
+#include <pthread.h>
+#include <string>
 #include <stdlib.h>
 
 struct Item
@@ -79,6 +109,117 @@ std::vector<Item> gen_array (int n_items, int n_swaps, bool rev)
     return items;
 }
 
+/*
+ * Adversarial inputs, built from ascending runs of chosen lengths.  Each run
+ * starts with the lowest value and ends with the highest, so that run
+ * boundaries are exactly where intended and every merge has to compare the
+ * two sub-lists all the way through.  Note that the algorithm runs
+ * right-to-left, so the rightmost run is the first pushed onto the stack.
+ */
+std::vector<Item> gen_runs (const std::vector<int> & lengths)
+{
+    std::vector<Item> items;
+
+    for (int len : lengths)
+    {
+        std::vector<int> vals;
+        for (int i = 0; i < len; i ++)
+            vals.push_back (1 + rand () % 1000000);
+
+        std::sort (vals.begin (), vals.end ());
+        vals.front () = 0;
+        if (len > 1)
+            vals.back () = 1000001;
+
+        for (int val : vals)
+            items.push_back (val);
+    }
+
+    /* index items to check stability later */
+    for (int i = 0; i < (int) items.size (); i ++)
+        items[i].idx = i;
+
+    return items;
+}
+
+/* The run lengths of the counterexample to TimSort's invariant given by
+ * de Gouw et al. (2015), mirrored for a right-to-left scan, and repeated at
+ * increasing scales. */
+std::vector<int> runs_timsort_breaking (int n_items)
+{
+    static const int pattern[] = {30, 20, 25, 80, 120};
+    std::vector<int> lengths;
+
+    for (int scale = 1, total = 0; total < n_items; scale = scale * 3 / 2 + 1)
+    {
+        for (int len : pattern)
+        {
+            lengths.insert (lengths.begin (), len * scale);
+            total += len * scale;
+        }
+    }
+
+    return lengths;
+}
+
+/* Fibonacci run lengths, growing either to the left or to the right */
+std::vector<int> runs_fibonacci (int n_items, bool grow_left)
+{
+    std::vector<int> lengths;
+
+    for (int a = 1, b = 1, total = 0; total < n_items; total += a)
+    {
+        lengths.push_back (a);
+        int c = a + b;
+        a = b;
+        b = c;
+    }
+
+    if (grow_left)
+        std::reverse (lengths.begin (), lengths.end ());
+
+    return lengths;
+}
+
+/* Blocks of runs that exactly satisfy the invariant (each half the length of
+ * its right-hand neighbor), preceded by a long run that forces a cascade of
+ * 3-way merges down the whole stack. */
+std::vector<int> runs_three_way (int n_items)
+{
+    std::vector<int> lengths;
+
+    for (int total = 0, depth = 2; total < n_items; depth ++)
+    {
+        std::vector<int> block;
+        int len = 1 << depth;
+
+        for (int i = 0; i < depth; i ++)
+        {
+            block.insert (block.begin (), len);
+            total += len;
+            len /= 2;
+        }
+
+        block.insert (block.begin (), (2 << depth) + 1);
+        total += (2 << depth) + 1;
+
+        lengths.insert (lengths.begin (), block.begin (), block.end ());
+    }
+
+    return lengths;
+}
+
+/* random run lengths over several orders of magnitude */
+std::vector<int> runs_random (int n_items)
+{
+    std::vector<int> lengths;
+
+    for (int total = 0; total < n_items; total += lengths.back ())
+        lengths.push_back (1 + rand () % (1 << (rand () % 12)));
+
+    return lengths;
+}
+
 /* verifies correct ordering as well as stability */
 void verify_sorted (const std::vector<Item> & items)
 {
@@ -105,10 +246,530 @@ void timsort (std::vector<Item> & items)
 void mergesort (std::vector<Item> & items)
     { mergesort (std::begin (items), std::end (items)); }
 
+/* sorts an adversarial input, checking the number of comparisons against
+ * c * N * log2 (N) and the depth of the run stack against log2 (N) + 1 */
+void check_adversarial (const std::vector<int> & lengths)
+{
+    std::vector<Item> items = gen_runs (lengths);
+    int n_items = items.size ();
+    long long n_compares = 0;
+
+    auto less = [& n_compares] (const Item & a, const Item & b)
+        { n_compares ++; return a < b; };
+
+    max_stack_depth = 0;
+    mergesort (std::begin (items), std::end (items), less);
+    verify_sorted (items);
+
+    if (n_items > 1 && n_compares > 2 * n_items * log2 (n_items))
+        abort ();
+    if (max_stack_depth > (int) log2 (n_items) + 1)
+        abort ();
+}
+
+/* Records too large for 64 of them to fit on a small thread stack.  The
+ * string makes this type non-relocatable, so that short lists would take the
+ * stack buffer if it were not limited in bytes. */
+struct BigRecord
+{
+    int val;
+    int idx;
+    std::string name;
+    unsigned char payload[8192];
+
+    bool operator< (const BigRecord & b) const
+        { return val < b.val; }
+};
+
+/* The same, but trivially copyable and so relocatable (see the raw-byte
+ * path in mergesort.h) */
+struct PlainRecord
+{
+    int val;
+    int idx;
+    unsigned char payload[8192];
+
+    bool operator< (const PlainRecord & b) const
+        { return val < b.val; }
+};
+
+static_assert (adaptive::detail::can_relocate<std::vector<PlainRecord>::iterator>::value,
+               "vector of PlainRecord not relocatable");
+
+template<typename Record>
+void check_big (int n_items)
+{
+    std::vector<Record> items (n_items);
+
+    for (int i = 0; i < n_items; i ++)
+    {
+        items[i].val = rand () % (n_items / 4 + 1);
+        items[i].idx = i;
+        memset (items[i].payload, i & 0xff, sizeof items[i].payload);
+    }
+
+    mergesort (items.begin (), items.end ());
+
+    for (int i = 0; i < n_items; i ++)
+    {
+        const Record & item = items[i];
+
+        if (item.payload[0] != (item.idx & 0xff) ||
+         item.payload[sizeof item.payload - 1] != (item.idx & 0xff))
+            abort ();
+        if (i > 0 && (items[i - 1].val > item.val ||
+         (items[i - 1].val == item.val && items[i - 1].idx > item.idx)))
+            abort ();
+    }
+}
+
+void * check_big_thread (void *)
+{
+    for (int n_items = 1; n_items <= 66; n_items ++)
+    {
+        check_big<BigRecord> (n_items);
+        check_big<PlainRecord> (n_items);
+    }
+
+    check_big<BigRecord> (1000);
+    check_big<PlainRecord> (1000);
+    return nullptr;
+}
+
+/* runs a check on a thread with a 256 KB stack, smaller than the default */
+void run_on_small_stack (void * (* check) (void *))
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    pthread_attr_init (& attr);
+    pthread_attr_setstacksize (& attr, 256 << 10);
+
+    if (pthread_create (& thread, & attr, check, nullptr) ||
+     pthread_join (thread, nullptr))
+        abort ();
+
+    pthread_attr_destroy (& attr);
+}
+
+/* relocatable but not trivially copyable, so sorted by raw byte moves */
+struct Boxed
+{
+    std::unique_ptr<std::pair<int, int>> item;
+
+    bool operator< (const Boxed & b) const
+        { return item->first < b.item->first; }
+};
+
+namespace adaptive {
+template<> struct is_trivially_relocatable<Boxed> : std::true_type {};
+}
+
+static_assert (adaptive::detail::can_relocate<std::vector<Boxed>::iterator>::value,
+               "vector of Boxed not relocatable");
+
+void check_relocate (int n_items)
+{
+    std::vector<Boxed> items (n_items);
+
+    for (int i = 0; i < n_items; i ++)
+        items[i].item.reset (new std::pair<int, int> (rand () % (n_items / 4 + 1), i));
+
+    mergesort (items.begin (), items.end ());
+
+    /* every pointer must still be there exactly once */
+    std::vector<bool> seen (n_items);
+
+    for (int i = 0; i < n_items; i ++)
+    {
+        int idx = items[i].item->second;
+
+        if (seen[idx])
+            abort ();
+        if (i > 0 && (items[i - 1].item->first > items[i].item->first ||
+             (items[i - 1].item->first == items[i].item->first &&
+              items[i - 1].item->second > idx)))
+            abort ();
+
+        seen[idx] = true;
+    }
+}
+
+/* Temporary storage for at most "size" items; longer lists are left alone */
+class BoundedBuffer
+{
+public:
+    BoundedBuffer (size_t size) :
+        size (size) { items.reserve (size); }
+
+    std::vector<Item>::iterator begin ()
+        { return items.begin (); }
+
+    bool holds (size_t n) const
+        { return n <= size; }
+
+    BoundedBuffer & assign (std::vector<Item>::iterator start,
+                            std::vector<Item>::iterator end)
+    {
+        if (holds (end - start))
+        {
+            items.clear ();
+            std::move (start, end, std::back_inserter (items));
+        }
+
+        return * this;
+    }
+
+private:
+    std::vector<Item> items;
+    size_t size;
+};
+
+/* sorts with temporary storage of various sizes down to none, so that merges
+ * too long for it are done in place */
+void check_bounded (int n_items, bool rev)
+{
+    for (size_t size = n_items; ; size /= 4)
+    {
+        std::vector<Item> items = gen_array (n_items, n_items / 8, rev);
+        BoundedBuffer buf (size);
+
+        mergesort (items.begin (), items.end (), std::less<Item> (),
+         [& buf] (std::vector<Item>::iterator start, std::vector<Item>::iterator end)
+            -> BoundedBuffer & { return buf.assign (start, end); });
+
+        verify_sorted (items);
+
+        if (! size)
+            break;
+    }
+}
+
+/* sorts concatenated sorted "shards" with and without their boundaries given;
+ * the result must be the same, with fewer comparisons when they are given */
+void check_runs (int n_items, int n_shards)
+{
+    std::vector<Item> items, items2;
+    std::vector<int> starts;
+
+    for (int s = 0; s < n_shards; s ++)
+    {
+        int shard_start = n_items * s / n_shards;
+        int shard_end = n_items * (s + 1) / n_shards;
+
+        starts.push_back (shard_start);
+
+        for (int i = shard_start; i < shard_end; i ++)
+        {
+            items.emplace_back (rand () % (n_items / 4 + 1));
+            items.back ().idx = i;
+        }
+
+        std::stable_sort (items.begin () + shard_start, items.end ());
+    }
+
+    for (const Item & item : items)
+    {
+        items2.emplace_back (item.val);
+        items2.back ().idx = item.idx;
+    }
+
+    std::vector<std::vector<Item>::iterator> bounds;
+    for (int start : starts)
+        bounds.push_back (items.begin () + start);
+
+    long long n_compares = 0, n_compares2 = 0;
+
+    mergesort_runs (items.begin (), items.end (), [& n_compares] (const Item & a, const Item & b)
+        { n_compares ++; return a < b; }, bounds);
+    mergesort (items2.begin (), items2.end (), [& n_compares2] (const Item & a, const Item & b)
+        { n_compares2 ++; return a < b; });
+
+    verify_sorted (items);
+
+    for (int i = 0; i < n_items; i ++)
+        if (items[i].idx != items2[i].idx)
+            abort ();
+
+    /* (very short shards are cheaper to sort by insertion than to merge) */
+    if (n_items >= 8 * n_shards && n_compares >= n_compares2)
+        abort ();
+}
+
+/* sorts three parallel columns by the first, each row tagged with its
+ * original position in every column */
+void check_zip (int n_items, bool sorted)
+{
+    std::vector<int> keys (n_items);
+    std::vector<std::string> names (n_items);
+    std::vector<int> rows (n_items);
+
+    for (int i = 0; i < n_items; i ++)
+    {
+        keys[i] = sorted ? i / 2 : rand () % (n_items / 4 + 1);
+        names[i] = std::to_string (i) + " (long enough to be heap-allocated)";
+        rows[i] = i;
+    }
+
+    std::vector<int> orig_keys = keys;
+
+    mergesort_zip ([] (int a, int b) { return a < b; },
+                   keys.begin (), keys.end (), names.begin (), rows.data ());
+
+    for (int i = 0; i < n_items; i ++)
+    {
+        int row = rows[i];
+
+        if (keys[i] != orig_keys[row] ||
+         names[i] != std::to_string (row) + " (long enough to be heap-allocated)")
+            abort ();
+        if (i > 0 && (keys[i - 1] > keys[i] ||
+         (keys[i - 1] == keys[i] && rows[i - 1] > row)))
+            abort ();
+    }
+}
+
+/* measures sorted, reversed, and random lists; the run counts and (for short
+ * lists) the inversion count are checked against a brute-force count */
+void check_presortedness (int n_items)
+{
+    auto less = [] (int a, int b) { return a < b; };
+    std::vector<int> ints (n_items);
+    double n_pairs = (double) n_items * (n_items - 1) / 2;
+
+    for (int i = 0; i < n_items; i ++)
+        ints[i] = i / 2;
+
+    adaptive::Presortedness p =
+     adaptive::measure_presortedness (ints.begin (), ints.end (), less);
+    if (p.n_items != (size_t) n_items || p.n_ascending_runs != (n_items > 0) ||
+     p.n_descending_runs != 0 || p.run_entropy != 0 || p.inversions != 0)
+        abort ();
+
+    for (int i = 0; i < n_items; i ++)
+        ints[i] = n_items - i;
+
+    p = adaptive::measure_presortedness (ints.begin (), ints.end (), less);
+    if (n_items > 1 && (p.n_ascending_runs != 0 || p.n_descending_runs != 1 ||
+     p.run_entropy != 0 || p.inversions != n_pairs))
+        abort ();
+
+    for (int i = 0; i < n_items; i ++)
+        ints[i] = rand () % (n_items / 4 + 1);
+
+    p = adaptive::measure_presortedness (ints.begin (), ints.end (), less);
+
+    size_t n_runs = 0, n_inversions = 0;
+    for (int i = 0; i < n_items; i ++)
+    {
+        for (int j = i + 1; j < n_items && n_items <= 1000; j ++)
+            n_inversions += (ints[j] < ints[i]);
+    }
+    for (int i = n_items - 1; i >= 0; n_runs ++)
+    {
+        if (i > 0 && ints[i] < ints[i - 1])
+            while (i > 0 && ints[i] < ints[i - 1]) i --;
+        else
+            while (i > 0 && ! (ints[i] < ints[i - 1])) i --;
+        i --;
+    }
+
+    if (p.n_ascending_runs + p.n_descending_runs != n_runs ||
+     p.run_entropy < 0 || (n_items > 0 && p.run_entropy > log2 (n_items) + 1e-9))
+        abort ();
+    if (n_pairs <= 1024 && p.inversions != n_inversions)
+        abort ();
+    /* a random list has about a quarter to a half of its pairs inverted */
+    if (n_pairs > 1024 && n_items <= 1000 &&
+     fabs (p.inversions - n_inversions) > 0.1 * n_pairs)
+        abort ();
+}
+
+/* the inversion count is exact up to 45 items (990 pairs) and sampled from
+ * 46 items (1035 pairs), where it can no longer be a whole number for a
+ * random list */
+void check_inversions_cutoff ()
+{
+    auto less = [] (int a, int b) { return a < b; };
+
+    for (int n_items : {45, 46})
+    {
+        std::vector<int> ints (n_items);
+        size_t n_inversions = 0;
+
+        for (int i = 0; i < n_items; i ++)
+            ints[i] = rand () % n_items;
+
+        for (int i = 0; i < n_items; i ++)
+        {
+            for (int j = i + 1; j < n_items; j ++)
+                n_inversions += (ints[j] < ints[i]);
+        }
+
+        adaptive::Presortedness p =
+         adaptive::measure_presortedness (ints.begin (), ints.end (), less);
+        if ((p.inversions == n_inversions) != (n_items == 45))
+            abort ();
+
+        check_presortedness (n_items);
+    }
+}
+
+#if __cplusplus >= 202002L
+
+#include <array>
+
+/* a table sorted at compile time, with many equal keys to check stability;
+ * 1000 entries take the std::vector path, 40 the short-list path */
+struct Entry
+{
+    int key;
+    int idx;
+};
+
+template<size_t N>
+constexpr std::array<Entry, N> sorted_table ()
+{
+    std::array<Entry, N> table {};
+    unsigned seed = 1;
+
+    for (int i = 0; i < (int) N; i ++)
+    {
+        seed = seed * 1103515245 + 12345;
+        table[i] = {(int) (seed >> 16) % 32, i};
+    }
+
+    mergesort (table.begin (), table.end (),
+     [] (const Entry & a, const Entry & b) { return a.key < b.key; });
+
+    return table;
+}
+
+template<size_t N>
+constexpr bool sorted_stably (const std::array<Entry, N> & table)
+{
+    for (int i = 0; i < (int) N - 1; i ++)
+    {
+        if (table[i].key > table[i + 1].key ||
+              (table[i].key == table[i + 1].key && table[i].idx > table[i + 1].idx))
+            return false;
+    }
+
+    return true;
+}
+
+constexpr std::array<int, 5> sorted_ints ()
+{
+    std::array<int, 5> ints = {3, 1, 4, 1, 5};
+    mergesort (ints.begin (), ints.end ());
+    return ints;
+}
+
+static_assert (sorted_stably (sorted_table<40> ()), "short table not sorted");
+static_assert (sorted_stably (sorted_table<1000> ()), "long table not sorted");
+static_assert (sorted_ints () == std::array<int, 5> {1, 1, 3, 4, 5}, "ints not sorted");
+
+#include <span>
+
+/* stops at the first negative key, like the terminator of a C string */
+struct NegativeKey
+{
+    friend bool operator== (const Entry * entry, NegativeKey)
+        { return entry->key < 0; }
+};
+
+/* sorts views and sentinel-delimited ranges through adaptive::ranges */
+void check_ranges (int n_items)
+{
+    std::vector<Entry> entries (n_items + 1);
+
+    for (int i = 0; i < n_items; i ++)
+        entries[i] = {rand () % (n_items / 4 + 1), i};
+
+    entries[n_items] = {-1, n_items};
+
+    /* projection returning a reference, on a span */
+    std::vector<Entry> by_member = entries;
+    std::span<Entry> span (by_member.data (), n_items);
+    auto end = adaptive::ranges::mergesort (span, {}, & Entry::key);
+
+    if (end != span.end () || ! std::is_sorted (span.begin (), span.end (),
+         [] (const Entry & a, const Entry & b) { return a.key < b.key; }))
+        abort ();
+
+    for (int i = 0; i < n_items - 1; i ++)
+        if (span[i].key == span[i + 1].key && span[i].idx > span[i + 1].idx)
+            abort ();
+
+    /* computed projection (reversing the order), up to a sentinel; the
+     * terminator must stay in place */
+    std::vector<Entry> by_value = entries;
+    auto key_count = 0;
+    auto negate = [& key_count] (const Entry & e) { key_count ++; return -e.key; };
+    auto end2 = adaptive::ranges::mergesort (by_value.data (), NegativeKey (), {}, negate);
+
+    if (end2 != by_value.data () + n_items || key_count != n_items ||
+         by_value[n_items].key != -1)
+        abort ();
+
+    /* the same as sorting by member with the comparison reversed */
+    adaptive::ranges::mergesort (entries.begin (), entries.end () - 1,
+                                 std::ranges::greater (), & Entry::key);
+
+    for (int i = 0; i < n_items; i ++)
+        if (by_value[i].key != entries[i].key || by_value[i].idx != entries[i].idx)
+            abort ();
+}
+
+#endif
+
 int main (void)
 {
     srand (0);
 
+    for (int n_items = 1; n_items < (1 << 20); n_items *= 4)
+    {
+        check_adversarial (runs_timsort_breaking (n_items));
+        check_adversarial (runs_fibonacci (n_items, false));
+        check_adversarial (runs_fibonacci (n_items, true));
+        check_adversarial (runs_three_way (n_items));
+        check_adversarial (runs_random (n_items));
+    }
+
+#if __cplusplus >= 202002L
+    for (int n_items = 0; n_items < 100000; n_items = n_items * 3 + 1)
+        check_ranges (n_items);
+#endif
+
+    for (int n_items = 0; n_items < 100000; n_items = n_items * 3 + 1)
+    {
+        check_relocate (n_items);
+        check_bounded (n_items, false);
+        check_bounded (n_items, true);
+    }
+
+    run_on_small_stack (check_big_thread);
+
+    for (int n_items = 0; n_items < 100000; n_items = n_items * 3 + 1)
+    {
+        check_runs (n_items, 1);
+        check_runs (n_items, 2);
+        check_runs (n_items, 16);
+        check_zip (n_items, false);
+        check_zip (n_items, true);
+        check_presortedness (n_items);
+    }
+
+    check_inversions_cutoff ();
+
+    /* every length around the stack-buffer cutoff */
+    for (int n_items = 1; n_items <= 66; n_items ++)
+    {
+        std::vector<Item> items = gen_array (n_items, n_items, false);
+        mergesort (items);
+        verify_sorted (items);
+    }
+
     for (int n_items = 1; n_items < 65536; n_items *= 2)
     {
         for (int n_swaps = 1; n_swaps < n_items; n_swaps *= 2)
@@ -28,277 +28,484 @@
  */
 
 #include "mergesort.h"
+#include "mergesort_define.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
-#include <glib.h>
 
-/* Inserts a single element into a sorted list */
+/* The sorting engine (see mergesort_define.h) can be left out by defining
+ * MERGESORT_CPP_ENGINE at compile time, in which case mergesort_cpp.cc
+ * provides it instead (see there).  Only mergesort_by_key() is then compiled
+ * from this file. */
+/* Default allocator, using the C library */
+static const MergeSortAllocator libc_allocator = {
+    mergesort_libc_realloc, mergesort_libc_free, NULL
+};
 
-static void insert_head (void * head, void * tail,
-                         int size, CompareFunc compare, void * context,
-                         void * * buf, int * buf_size)
+#ifndef MERGESORT_CPP_ENGINE
+
+static int compare_less (const char * a, const char * b, CompareFunc compare,
+                         void * context)
 {
-    uint32_t temp4;
-    uint64_t temp8;
-    void * dest;
+    return compare (a, b, context) < 0;
+}
 
-    switch (size)
-    {
-    case 4:
-        /* optimized version for 32-bit word */
-        temp4 = * (uint32_t *) head;
-        * (uint32_t *) head = * (uint32_t *) (head + 4);
+/* the generic engine, expanded for the common element sizes */
+MERGESORT_SORTS (generic, compare_less)
 
-        for (dest = head + 4; dest + 4 < tail; dest += 4)
-        {
-            if (compare (& temp4, dest + 4, context) < 1)
-                break;
+#endif /* MERGESORT_CPP_ENGINE */
 
-            * (uint32_t *) dest = * (uint32_t *) (dest + 4);
-        }
+/* Elements larger than this are sorted indirectly: an array of pointers to
+ * them is sorted instead, so that each level of merging moves pointers rather
+ * than whole elements, and then the elements are moved into place once. */
 
-        * (uint32_t *) dest = temp4;
-        break;
+#define INDIRECT_SIZE 128
 
-    case 8:
-        /* optimized version for 64-bit word */
-        temp8 = * (uint64_t *) head;
-        * (uint64_t *) head = * (uint64_t *) (head + 8);
+#ifndef MERGESORT_CPP_ENGINE
 
-        for (dest = head + 8; dest + 8 < tail; dest += 8)
-        {
-            if (compare (& temp8, dest + 8, context) < 1)
-                break;
+typedef struct {
+    CompareFunc compare;
+    void * context;
+} IndirectContext;
 
-            * (uint64_t *) dest = * (uint64_t *) (dest + 8);
-        }
+static int compare_indirect (const void * a, const void * b, void * context)
+{
+    const IndirectContext * ic = context;
+    return ic->compare (* (void * const *) a, * (void * const *) b,
+                        ic->context);
+}
 
-        * (uint64_t *) dest = temp8;
-        break;
+static void sort_indirect (void * items, size_t n_items, size_t size,
+                           CompareFunc compare, void * context,
+                           MergeSortBuffer * buf)
+{
+    /* one allocation holds the pointers and a temporary element */
+    void * * ptrs = mergesort_checked_realloc (buf->allocator, NULL,
+                                     n_items * sizeof (void *) + size);
 
-    default:
-        /* generic version */
-        if (* buf_size < size)
-        {
-            * buf = g_realloc (* buf, size);
-            * buf_size = size;
-        }
+    for (size_t i = 0; i < n_items; i ++)
+        ptrs[i] = items + i * size;
 
-        for (dest = head + size; dest + size < tail; dest += size)
-        {
-            if (compare (head, dest + size, context) < 1)
-                break;
-        }
+    IndirectContext ic = {compare, context};
+    generic_sort ((char *) ptrs, n_items, sizeof (void *), compare_indirect,
+                  & ic, buf);
 
-        memcpy (* buf, head, size);
-        memmove (head, head + size, dest - head);
-        memcpy (dest, * buf, size);
-        break;
+    mergesort_permute_items (items, n_items, size, ptrs, ptrs + n_items);
+
+    buf->allocator->free (ptrs, buf->allocator->context);
+}
+
+void mergesort_with_allocator (void * items, size_t n_items, size_t size,
+                               CompareFunc compare, void * context,
+                               const MergeSortAllocator * allocator)
+{
+    /* A list with 0 or 1 element (or of empty elements) is sorted by
+     * definition. */
+    if (n_items < 2 || ! size)
+        return;
+
+    MergeSortBuffer buf = {NULL, 0, allocator ? allocator : & libc_allocator};
+
+    if (size > INDIRECT_SIZE)
+        sort_indirect (items, n_items, size, compare, context, & buf);
+    else
+        generic_sort (items, n_items, size, compare, context, & buf);
+
+    /* release any temporary storage used */
+    if (buf.data)
+        buf.allocator->free (buf.data, buf.allocator->context);
+}
+
+void mergesort_with_buffer (void * items, size_t n_items, size_t size,
+                            CompareFunc compare, void * context,
+                            void * scratch, size_t scratch_bytes)
+{
+    if (n_items < 2 || ! size)
+        return;
+
+    scratch = mergesort_align_scratch (scratch, & scratch_bytes);
+    MergeSortBuffer buf = {scratch, scratch_bytes, NULL};
+
+    generic_sort (items, n_items, size, compare, context, & buf);
+}
+
+#endif /* MERGESORT_CPP_ENGINE */
+
+/* Sorting by a key of known type (see mergesort_by_key()).  The key of each
+ * item is loaded once and transformed into an unsigned integer that sorts in
+ * the same order, and the items are then sorted by an LSD radix sort on that
+ * integer, one byte per pass.  Keys of more than 8 bytes, short lists, and
+ * lists that are already nearly sorted forward or in reverse (fewer than one
+ * descent, or ascent, per RADIX_RUN items) are merge-sorted by comparing keys
+ * instead, since merge sort is adaptive and radix sort is not.  The engine
+ * (see mergesort_define.h) is then expanded for each key type, so that the
+ * keys are compared inline rather than through a compare function. */
+
+#define RADIX_MIN 256
+#define RADIX_RUN 8
+
+typedef struct {
+    size_t offset;
+    size_t width;
+    int type;
+    int descending;
+    uint64_t flip;  /* all ones if descending, otherwise 0 */
+} KeySpec;
+
+/* Returns the size of a key in bytes, or 0 if the type is invalid */
+static size_t key_width (int type)
+{
+    switch (type)
+    {
+    case MERGESORT_KEY_U32:
+    case MERGESORT_KEY_I32:
+    case MERGESORT_KEY_F32:
+        return 4;
+    case MERGESORT_KEY_U64:
+    case MERGESORT_KEY_I64:
+    case MERGESORT_KEY_F64:
+        return 8;
+    default:
+        if (type > MERGESORT_KEY_BYTES (0))
+            return type - MERGESORT_KEY_BYTES (0);
+        return 0;
     }
 }
 
-/* Merges two sorted sub-lists */
+/* Each of these loads a key as an unsigned integer of the same order.  Signed
+ * integers have their sign bit flipped; negative floating-point values have
+ * all bits flipped and positive ones only the sign bit (this orders -0 before
+ * +0, and NaNs beyond the infinities of the same sign). */
+
+static uint64_t key_u32 (const void * p)
+{
+    uint32_t k;
+    memcpy (& k, p, 4);
+    return k;
+}
+
+static uint64_t key_i32 (const void * p)
+{
+    return key_u32 (p) ^ UINT32_C (0x80000000);
+}
+
+static uint64_t key_f32 (const void * p)
+{
+    uint32_t k = key_u32 (p);
+    return k ^ ((k >> 31) ? UINT32_C (0xffffffff) : UINT32_C (0x80000000));
+}
+
+static uint64_t key_u64 (const void * p)
+{
+    uint64_t k;
+    memcpy (& k, p, 8);
+    return k;
+}
+
+static uint64_t key_i64 (const void * p)
+{
+    return key_u64 (p) ^ (UINT64_C (1) << 63);
+}
+
+static uint64_t key_f64 (const void * p)
+{
+    uint64_t k = key_u64 (p);
+    return k ^ ((k >> 63) ? ~ UINT64_C (0) : UINT64_C (1) << 63);
+}
 
-static void do_merge (void * head, void * mid, void * tail,
-                      int size, CompareFunc compare, void * context,
-                      void * * buf, int * buf_size)
+/* byte strings of up to 8 bytes are loaded big-endian */
+static uint64_t load_key (const void * item, const KeySpec * spec)
 {
-    if (* buf_size < mid - head)
+    const unsigned char * p = item + spec->offset;
+    uint64_t key = 0;
+
+    switch (spec->type)
     {
-        * buf = g_realloc (* buf, mid - head);
-        * buf_size = mid - head;
+    case MERGESORT_KEY_U32: key = key_u32 (p); break;
+    case MERGESORT_KEY_I32: key = key_i32 (p); break;
+    case MERGESORT_KEY_F32: key = key_f32 (p); break;
+    case MERGESORT_KEY_U64: key = key_u64 (p); break;
+    case MERGESORT_KEY_I64: key = key_i64 (p); break;
+    case MERGESORT_KEY_F64: key = key_f64 (p); break;
+
+    default:
+        for (size_t i = 0; i < spec->width; i ++)
+            key = (key << 8) | p[i];
+        break;
     }
 
-    /* copy list "a" to temporary storage */
-    memcpy (* buf, head, mid - head);
+    if (spec->descending)
+        key = ~ key & (~ UINT64_C (0) >> (64 - 8 * spec->width));
+
+    return key;
+}
+
+/* Merge sorts by key, one for each type of key.  Each sorts an array of
+ * pointers to the items by comparing the keys inline (in descending order by
+ * flipping all their bits); the items are then moved into place once.  The
+ * context is the KeySpec. */
+
+#define DEFINE_KEY_LESS(type) \
+static inline int less_##type (const char * a, const char * b, \
+                               const KeySpec * spec) \
+{ \
+    return (key_##type (a + spec->offset) ^ spec->flip) < \
+           (key_##type (b + spec->offset) ^ spec->flip); \
+}
+
+DEFINE_KEY_LESS (u32)
+DEFINE_KEY_LESS (i32)
+DEFINE_KEY_LESS (f32)
+DEFINE_KEY_LESS (u64)
+DEFINE_KEY_LESS (i64)
+DEFINE_KEY_LESS (f64)
+
+/* byte strings of any length compare as by memcmp() */
+static inline int less_bytes (const char * a, const char * b,
+                              const KeySpec * spec)
+{
+    int cmp = memcmp (a + spec->offset, b + spec->offset, spec->width);
+    return spec->descending ? cmp > 0 : cmp < 0;
+}
+
+#define DEFINE_KEY_SORT(type) \
+static inline int less_##type##_ptr (const char * a, const char * b, \
+                                     CompareFunc compare, void * context) \
+{ \
+    return less_##type (* (char * const *) a, * (char * const *) b, context); \
+} \
+\
+MERGESORT_ENGINE (key_##type, sizeof (void *), less_##type##_ptr)
+
+DEFINE_KEY_SORT (u32)
+DEFINE_KEY_SORT (i32)
+DEFINE_KEY_SORT (f32)
+DEFINE_KEY_SORT (u64)
+DEFINE_KEY_SORT (i64)
+DEFINE_KEY_SORT (f64)
+DEFINE_KEY_SORT (bytes)
+
+typedef void (* KeySortFunc) (char * items, size_t n_items, size_t size,
+                              CompareFunc compare, void * context,
+                              MergeSortBuffer * buf);
+
+/* indexed by key type, with byte strings at 0 */
+static const KeySortFunc key_sorts[] = {
+    [0] = key_bytes_sort,
+    [MERGESORT_KEY_U32] = key_u32_sort,
+    [MERGESORT_KEY_I32] = key_i32_sort,
+    [MERGESORT_KEY_U64] = key_u64_sort,
+    [MERGESORT_KEY_I64] = key_i64_sort,
+    [MERGESORT_KEY_F32] = key_f32_sort,
+    [MERGESORT_KEY_F64] = key_f64_sort
+};
+
+static void merge_by_key (void * items, size_t n_items, size_t size,
+                          KeySpec * spec)
+{
+    KeySortFunc sort =
+        key_sorts[(spec->type <= MERGESORT_KEY_F64) ? spec->type : 0];
+    MergeSortBuffer buf = {NULL, 0, & libc_allocator};
+    void * local[RADIX_MIN];
+
+    /* short lists keep their pointers on the stack */
+    void * * ptrs = local;
+    if (n_items > RADIX_MIN)
+        ptrs = mergesort_checked_realloc (& libc_allocator, NULL,
+                                          n_items * sizeof (void *));
+
+    for (size_t i = 0; i < n_items; i ++)
+        ptrs[i] = (char *) items + i * size;
 
-    const void * a = * buf;
-    const void * a_end = a + (mid - head);
-    const void * b = mid;
-    void * dest = head;
+    sort ((char *) ptrs, n_items, sizeof (void *), NULL, spec, & buf);
 
-    /* Handle the case of strictly separate (but reversed) lists specially.
-     * In this case, we simply shift list "b" to the left. */
-    if (compare (a, tail - size, context) > 0)
+    /* the merge buffer is free again, to hold the temporary element */
+    mergesort_permute_items (items, n_items, size, ptrs,
+                             mergesort_reserve (& buf, size));
+
+    free (buf.data);
+    if (ptrs != local)
+        free (ptrs);
+}
+
+/* One pass of the radix sort: distributes the items (and their keys) into
+ * dest by the byte of the key at "shift".  The loop is expanded for the
+ * common element sizes, so that the copies have a constant size, and the
+ * size is chosen once per pass. */
+#define SCATTER_ITEMS(n) \
+    do { \
+        for (size_t i = 0; i < n_items; i ++) \
+        { \
+            size_t d = offsets[(keys[i] >> shift) & 0xff] ++; \
+\
+            keys2[d] = keys[i]; \
+            memcpy (items2 + d * n, items + i * n, n); \
+        } \
+    } while (0)
+
+/* Sorts the items by their keys, using keys2 and items2 as temporary storage.
+ * Returns whichever of items or items2 holds the result. */
+static void * radix_sort (uint64_t * keys, uint64_t * keys2,
+                          void * items, void * items2,
+                          size_t n_items, size_t size, size_t width)
+{
+    size_t counts[8][256] = {{0}};
+
+    /* count the occurrences of each byte value at all positions at once */
+    for (size_t i = 0; i < n_items; i ++)
     {
-        memmove (dest, b, tail - b);
-        dest += tail - b;
-        b = tail;
+        for (size_t p = 0; p < width; p ++)
+            counts[p][(keys[i] >> (8 * p)) & 0xff] ++;
     }
 
-    /* intersperse elements */
-    switch (size)
+    for (size_t p = 0; p < width; p ++)
     {
-    case 4:
-        /* optimized version for 32-bit word */
-        for (; a < a_end && b < tail; dest += 4)
-        {
-            if (compare (a, b, context) < 1) {
-                * (int32_t *) dest = * (int32_t *) a;
-                a += 4;
-            } else {
-                * (int32_t *) dest = * (int32_t *) b;
-                b += 4;
-            }
-        }
+        int shift = 8 * p;
+        size_t offsets[256], total = 0;
 
-        break;
+        /* skip the pass if all keys have the same byte here */
+        if (counts[p][(keys[0] >> shift) & 0xff] == n_items)
+            continue;
 
-    case 8:
-        /* optimized version for 64-bit word */
-        for (; a < a_end && b < tail; dest += 8)
+        for (int d = 0; d < 256; d ++)
         {
-            if (compare (a, b, context) < 1) {
-                * (int64_t *) dest = * (int64_t *) a;
-                a += 8;
-            } else {
-                * (int64_t *) dest = * (int64_t *) b;
-                b += 8;
-            }
+            offsets[d] = total;
+            total += counts[p][d];
         }
 
-        break;
-
-    default:
-        /* generic version */
-        for (; a < a_end && b < tail; dest += size)
+        switch (size)
         {
-            if (compare (a, b, context) < 1) {
-                memcpy (dest, a, size);
-                a += size;
-            } else {
-                memcpy (dest, b, size);
-                b += size;
-            }
+        case 4: SCATTER_ITEMS (4); break;
+        case 8: SCATTER_ITEMS (8); break;
+        case 12: SCATTER_ITEMS (12); break;
+        case 16: SCATTER_ITEMS (16); break;
+        case 24: SCATTER_ITEMS (24); break;
+        case 32: SCATTER_ITEMS (32); break;
+        case 64: SCATTER_ITEMS (64); break;
+        case 128: SCATTER_ITEMS (128); break;
+        default: SCATTER_ITEMS (size); break;
         }
 
-        break;
+        uint64_t * swap_keys = keys;
+        keys = keys2;
+        keys2 = swap_keys;
+
+        void * swap_items = items;
+        items = items2;
+        items2 = swap_items;
     }
 
-    /* copy remainder of list "a" */
-    if (a < a_end)
-        memcpy (dest, a, a_end - a);
+    return items;
 }
 
-/* Top-level merge sort algorithm */
-
-void mergesort (void * items, int n_items, int size,
-                CompareFunc compare, void * context)
+void mergesort_by_key (void * items, size_t n_items, size_t size,
+                       size_t key_offset, int key_type, int descending)
 {
-    /* A list with 0 or 1 element is sorted by definition. */
-    if (n_items < 2)
+    KeySpec spec = {key_offset, key_width (key_type), key_type, descending,
+                    descending ? ~ UINT64_C (0) : 0};
+    size_t width = spec.width;
+
+    if (! width)
+        abort ();
+
+    if (n_items < 2 || ! size)
         return;
 
-    void * buf = NULL;
-    int buf_size = 0;
+    /* Large items are sorted indirectly (as in sort_indirect()), so that the
+     * radix passes move pointers rather than whole items. */
+    int indirect = (size > INDIRECT_SIZE);
+    size_t item_size = indirect ? sizeof (void *) : size;
+    void * mem = NULL;
 
-    /* The algorithm runs right-to-left (so that insertions are left-to-right). */
-    void * head = items + n_items * size;
-    void * mid, * tail, * tail2;
+    if (width <= 8 && n_items >= RADIX_MIN)
+    {
+        size_t bytes = n_items * (2 * sizeof (uint64_t) + item_size);
+        if (indirect)
+            bytes += n_items * sizeof (void *) + size;
 
-    /* Markers recording the divisions between sorted sub-lists or "runs".
-     * Each run is at least 2x the length of its left-hand neighbor, so in
-     * theory a list of 2^64 - 1 elements will have no more than 64 runs. */
-    void * div[64];
-    int n_div = 0;
+        mem = malloc (bytes);
+    }
 
-    do
+    if (! mem)
     {
-        mid = head;
-        head = mid - size;
+        merge_by_key (items, n_items, size, & spec);
+        return;
+    }
 
-        /* Scan right-to-left to find a run of increasing values.
-         * If necessary, use insertion sort to create a run at 4 values long.
-         * At this scale, insertion sort is faster due to lower overhead. */
-        while (head > items)
-        {
-            if (compare (head - size, head, context) > 0)
-            {
-                if (mid - head < 4 * size)
-                    insert_head (head - size, mid, size, compare, context, & buf, & buf_size);
-                else
-                    break;
-            }
-
-            head -= size;
-        }
+    uint64_t * keys = mem;
+    uint64_t * keys2 = keys + n_items;
+    void * items2 = keys2 + n_items;
+    void * * ptrs = items2 + n_items * item_size;
 
-        /* Merge/collapse sub-lists left-to-right to maintain the invariant. */
-        while (n_div >= 1)
+    size_t n_descents = 0, n_ascents = 0;
+
+    for (size_t i = 0; i < n_items; i ++)
+    {
+        keys[i] = load_key (items + i * size, & spec);
+
+        if (i > 0)
         {
-            tail = div[n_div - 1];
-
-            while (n_div >= 2)
-            {
-                tail2 = div[n_div - 2];
-
-                /*
-                 * Check for the occasional case where the new sub-list is
-                 * longer than both the two previous.  In this case, a "3-way"
-                 * merge is performed as follows:
-                 *
-                 *   |---------- #6 ----------|- #5 -|---- #4 ----| ...
-                 *
-                 * First, the two previous sub-lists (#5 and #4) are merged.
-                 * (This is more balanced and therefore more efficient than
-                 * merging the long #6 with the short #5.)
-                 *
-                 *   |---------- #5 ----------|-------- #4 -------| ...
-                 *
-                 * The invariant guarantees that the newly merged sub-list (#4)
-                 * will be shorter than its right-hand neighbor (#3).
-                 *
-                 * At this point we loop, and one of two things can happen:
-                 *
-                 *  1) If sub-list #5 is no longer than #3, we drop out of the
-                 *     loop.  #5 is still longer than half of #4, so a 2-way
-                 *     merge will be required to restore the invariant.
-                 *
-                 *  2) If #5 is longer than even #3 (rare), we perform another
-                 *     3-way merge, starting with #4 and #3.  The same result
-                 *     holds true: the newly merged #3 will again be shorter
-                 *     than its right-hand neighbour (#2).  In this fashion the
-                 *     process can be continued down the line with no more than
-                 *     two sub-lists violating the invariant at any given time.
-                 *     Eventually no more 3-way merges can be performed, and the
-                 *     invariant is restored by a final 2-way merge.
-                 */
-
-                if ((mid - head) <= (tail2 - tail))
-                    break;
-
-                do_merge (mid, tail, tail2, size, compare, context, & buf, & buf_size);
-
-                tail = tail2;
-                n_div --;
-            }
-
-            /*
-             * Otherwise, check whether the new sub-list is longer than half its
-             * right-hand neighbour.  If so, merge the two sub-lists.  The
-             * merged sub-list may in turn be longer than its own right-hand
-             * neighbor, and if so the entire process is repeated.
-             *
-             * Once the "head" pointer reaches the beginning of the original
-             * list, we simply keep merging until only one sub-list remains.
-             */
-
-            if (head > items && (mid - head) <= (tail - mid) / 2)
-                break;
-
-            do_merge (head, mid, tail, size, compare, context, & buf, & buf_size);
-
-            mid = tail;
-            n_div --;
+            n_descents += (keys[i] < keys[i - 1]);
+            n_ascents += (keys[i] > keys[i - 1]);
         }
+    }
+
+    if (n_descents < n_items / RADIX_RUN || n_ascents < n_items / RADIX_RUN)
+    {
+        free (mem);
+
+        if (n_descents > 0)
+            merge_by_key (items, n_items, size, & spec);
+
+        return;
+    }
+
+    if (indirect)
+    {
+        for (size_t i = 0; i < n_items; i ++)
+            ptrs[i] = (char *) items + i * size;
 
-        /* push the new sub-list onto the stack */
-        div[n_div] = mid;
-        n_div ++;
+        void * * sorted = radix_sort (keys, keys2, ptrs, items2, n_items,
+                                      item_size, width);
+
+        mergesort_permute_items (items, n_items, size, sorted, ptrs + n_items);
     }
-    while (head > items);
+    else
+    {
+        void * sorted = radix_sort (keys, keys2, items, items2, n_items,
+                                    item_size, width);
 
-    /* release any temporary storage used */
-    g_free (buf);
+        if (sorted != items)
+            memcpy (items, sorted, n_items * size);
+    }
+
+    free (mem);
+}
+
+#ifndef MERGESORT_CPP_ENGINE
+
+size_t mergesort_scratch_size (size_t n_items, size_t size)
+{
+    /* only the shorter list of each merge is copied, plus room to align the
+     * start of the buffer (see mergesort_with_buffer()) */
+    size_t bytes = (n_items / 2) * size;
+    return bytes ? bytes + MERGESORT_ALIGN - 1 : 0;
+}
+
+void mergesort64 (void * items, size_t n_items, size_t size,
+                  CompareFunc compare, void * context)
+{
+    mergesort_with_allocator (items, n_items, size, compare, context, NULL);
 }
+
+void mergesort (void * items, int n_items, int size,
+                CompareFunc compare, void * context)
+{
+    if (n_items < 2 || ! size)
+        return;
+
+    mergesort64 (items, n_items, size, compare, context);
+}
+
+#endif /* MERGESORT_CPP_ENGINE */
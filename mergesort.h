@@ -20,9 +20,90 @@
 #ifndef MERGESORT_H
 #define MERGESORT_H
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
 typedef int (* CompareFunc) (const void * a, const void * b, void * context);
 
+/* Sorts n_items elements of the given size (in bytes) in ascending order, as
+ * determined by the compare function.  The sort is stable. */
+void mergesort64 (void * items, size_t n_items, size_t size,
+                  CompareFunc compare, void * context);
+
+/* Callbacks used to allocate temporary storage.  realloc() has the semantics
+ * of the C library function (it is passed NULL for the first allocation) and
+ * is called with the context pointer given here.  free() is called once at
+ * the end of the sort if any storage was allocated.  If realloc() fails, the
+ * program is aborted. */
+typedef struct {
+    void * (* realloc) (void * ptr, size_t size, void * context);
+    void (* free) (void * ptr, void * context);
+    void * context;
+} MergeSortAllocator;
+
+/* Same as mergesort64(), but allocates temporary storage through the given
+ * callbacks.  If allocator is NULL, realloc() and free() from the C library
+ * are used. */
+void mergesort_with_allocator (void * items, size_t n_items, size_t size,
+                               CompareFunc compare, void * context,
+                               const MergeSortAllocator * allocator);
+
+/* Same as mergesort64(), but never allocates memory.  Temporary storage is
+ * taken from the caller-supplied scratch buffer; where that is too small, the
+ * sort falls back to (slower) merging in place, so any size including zero
+ * is allowed.  The buffer need not be aligned: its start is rounded up to the
+ * alignment of the most strictly aligned types, so that the compare function
+ * always gets aligned elements. */
+void mergesort_with_buffer (void * items, size_t n_items, size_t size,
+                            CompareFunc compare, void * context,
+                            void * scratch, size_t scratch_bytes);
+
+/* Returns the scratch buffer size in bytes with which mergesort_with_buffer()
+ * never needs to merge in place: n_items / 2 * size, since only the shorter
+ * list of each merge is copied, plus room to align the start of the buffer. */
+size_t mergesort_scratch_size (size_t n_items, size_t size);
+
+/* Same as mergesort64(), but uses up to n_threads POSIX threads (or one per
+ * online CPU if n_threads is 0).  The compare function is called from several
+ * threads at once, so it must be safe to do so.  Temporary storage of
+ * n_items * size bytes is allocated with malloc(); if that fails, or the list
+ * is too short to be worth splitting, the list is sorted on the calling thread
+ * only.  Defined in mergesort_parallel.c, which must be linked with -pthread. */
+void mergesort_parallel (void * items, size_t n_items, size_t size,
+                         CompareFunc compare, void * context, int n_threads);
+
+/* Key types for mergesort_by_key() */
+enum {
+    MERGESORT_KEY_U32 = 1,
+    MERGESORT_KEY_I32,
+    MERGESORT_KEY_U64,
+    MERGESORT_KEY_I64,
+    MERGESORT_KEY_F32,
+    MERGESORT_KEY_F64
+};
+
+/* A key of n bytes (n >= 1), ordered as by memcmp() */
+#define MERGESORT_KEY_BYTES(n) (0x100 + (n))
+
+/* Sorts the items stably by a key of the given type, stored (in native byte
+ * order, not necessarily aligned) at key_offset bytes into each item.  Since
+ * the key layout is known, no comparison function is called; most key types
+ * are sorted by radix sort.  Floating-point keys are ordered with -0 before
+ * +0, and with NaNs beyond the infinities of the same sign.  If descending
+ * is non-zero, the order is reversed (but items with equal keys still keep
+ * their original order).  Temporary storage is allocated with malloc(). */
+void mergesort_by_key (void * items, size_t n_items, size_t size,
+                       size_t key_offset, int key_type, int descending);
+
+/* Equivalent to mergesort64(), for existing callers using int sizes */
 void mergesort (void * items, int n_items, int size,
                 CompareFunc compare, void * context);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
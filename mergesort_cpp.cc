@@ -0,0 +1,504 @@
+/*
+ * Adaptive Merge Sort
+ * Copyright 2017-2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * The C API of mergesort.c, implemented on top of the C++ template in
+ * cpp/mergesort.h, so that both APIs share one sorting engine.  This file
+ * replaces the engine in mergesort.c, which must then be compiled with
+ * -DMERGESORT_CPP_ENGINE (see the libmergesort_cpp.a target in the Makefile).
+ *
+ * Elements of 1 to 64 bytes are sorted as objects of a fixed-size type, so
+ * that each size has its own instantiation of the template, with the moves
+ * inlined.  Larger elements take a generic path: an array of pointers to them
+ * is sorted instead, and the elements are then moved into place once.
+ *
+ * mergesort_with_buffer() gives the template temporary storage of limited
+ * size, so that merges which do not fit in it are done in place (see
+ * cpp/mergesort.h).  For larger elements, the array of pointers is taken from
+ * the scratch buffer too.  If that does not fit, the elements are sorted
+ * directly instead, by an instantiation of the template for elements of
+ * run-time size, which can work entirely in place.
+ */
+
+#include "mergesort.h"
+#include "mergesort_define.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <iterator>
+#include <utility>
+
+/* An iterator over elements whose size is known only at run time, for
+ * mergesort_with_buffer() when even the array of pointers to large elements
+ * does not fit in the scratch buffer.  Dereferencing gives a pointer to the
+ * element, and elements are moved through the functions below, chosen by the
+ * RuntimeSize tag (passed to the template in place of "Relocate"). */
+
+struct SizedIter
+{
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef char * value_type;
+    typedef ptrdiff_t difference_type;
+    typedef char * * pointer;
+    typedef char * reference;
+
+    char * p;
+    size_t size;
+
+    char * operator* () const
+        { return p; }
+    char * operator[] (ptrdiff_t n) const
+        { return p + n * (ptrdiff_t) size; }
+
+    explicit operator void * () const
+        { return p; }
+
+    SizedIter & operator++ ()
+        { p += size; return * this; }
+    SizedIter & operator-- ()
+        { p -= size; return * this; }
+    SizedIter operator++ (int)
+        { SizedIter it = * this; p += size; return it; }
+    SizedIter operator-- (int)
+        { SizedIter it = * this; p -= size; return it; }
+
+    SizedIter & operator+= (ptrdiff_t n)
+        { p += n * (ptrdiff_t) size; return * this; }
+    SizedIter & operator-= (ptrdiff_t n)
+        { p -= n * (ptrdiff_t) size; return * this; }
+
+    SizedIter operator+ (ptrdiff_t n) const
+        { return {p + n * (ptrdiff_t) size, size}; }
+    SizedIter operator- (ptrdiff_t n) const
+        { return {p - n * (ptrdiff_t) size, size}; }
+    ptrdiff_t operator- (const SizedIter & b) const
+        { return (p - b.p) / (ptrdiff_t) size; }
+
+    bool operator== (const SizedIter & b) const { return p == b.p; }
+    bool operator!= (const SizedIter & b) const { return p != b.p; }
+    bool operator< (const SizedIter & b) const { return p < b.p; }
+    bool operator> (const SizedIter & b) const { return p > b.p; }
+    bool operator<= (const SizedIter & b) const { return p <= b.p; }
+    bool operator>= (const SizedIter & b) const { return p >= b.p; }
+};
+
+struct RuntimeSize {};
+
+static void move_item (SizedIter src, SizedIter dest, RuntimeSize)
+{
+    memcpy (dest.p, src.p, src.size);
+}
+
+static void move_items (SizedIter start, SizedIter end, SizedIter dest,
+                        RuntimeSize)
+{
+    memmove (dest.p, start.p, end.p - start.p);
+}
+
+static void move_items_backward (SizedIter start, SizedIter end,
+                                 SizedIter dest_end, RuntimeSize)
+{
+    memmove (dest_end.p - (end.p - start.p), start.p, end.p - start.p);
+}
+
+static void swap_items (SizedIter a, SizedIter b, RuntimeSize)
+{
+    mergesort_swap_items (a.p, b.p, a.size);
+}
+
+/* The scratch buffer is in use by the merges, so the blocks are exchanged in
+ * place (see mergesort_rotate()) */
+static void rotate_items (SizedIter head, SizedIter mid, SizedIter tail,
+                          RuntimeSize)
+{
+    MergeSortBuffer none = {nullptr, 0, nullptr};
+    mergesort_rotate (head.p, mid.p, tail.p, head.size, & none);
+}
+
+static void rotate_left (SizedIter head, SizedIter dest, RuntimeSize)
+{
+    rotate_items (head, head + 1, dest, RuntimeSize ());
+}
+
+/* Forwards the C test hook (see mergesort_define.h) to the hook of the
+ * template */
+#ifdef MERGESORT_STACK
+template<typename Iter>
+static void stack_hook (Iter head, const Iter * div, int n_div)
+{
+    void * ptrs[64];
+
+    for (int i = 0; i < n_div; i ++)
+        ptrs[i] = static_cast<void *> (div[i]);
+
+    MERGESORT_STACK (static_cast<void *> (head), ptrs, n_div);
+}
+
+#undef MERGESORT_STACK
+#define MERGESORT_STACK(head, div, n_div) stack_hook (head, div, n_div)
+#endif
+
+#include "cpp/mergesort.h"
+
+/* Largest element size with its own instantiation */
+#define MAX_DIRECT_SIZE 64
+
+/* An element of N bytes, moved as a whole */
+template<size_t N>
+struct Item
+{
+    unsigned char bytes[N];
+};
+
+/* Adapts the C compare function to the "less" parameter of the template.  The
+ * generic path compares pointers to the elements rather than the elements
+ * themselves. */
+
+struct ItemLess
+{
+    CompareFunc compare;
+    void * context;
+
+    template<typename T>
+    bool operator() (const T & a, const T & b) const
+        { return compare (& a, & b, context) < 0; }
+};
+
+struct IndirectLess
+{
+    CompareFunc compare;
+    void * context;
+
+    bool operator() (const void * a, const void * b) const
+        { return compare (a, b, context) < 0; }
+};
+
+/* Temporary storage for the "copy" parameter of the template, grown as needed
+ * through the allocator */
+template<typename T>
+class AllocBuffer
+{
+public:
+    AllocBuffer (const MergeSortAllocator * allocator) :
+        allocator (allocator) {}
+
+    AllocBuffer (const AllocBuffer &) = delete;
+    AllocBuffer & operator= (const AllocBuffer &) = delete;
+
+    ~AllocBuffer ()
+    {
+        if (data)
+            allocator->free (data, allocator->context);
+    }
+
+    T * begin ()
+        { return data; }
+
+    AllocBuffer & assign (const T * start, const T * end)
+    {
+        size_t n = end - start;
+
+        if (n > size)
+        {
+            void * mem = allocator->realloc (data, n * sizeof (T),
+                                             allocator->context);
+
+            /* there is no way to report failure to the caller */
+            if (! mem)
+                abort ();
+
+            data = static_cast<T *> (mem);
+            size = n;
+        }
+
+        std::copy (start, end, data);
+        return * this;
+    }
+
+private:
+    const MergeSortAllocator * allocator;
+    T * data = nullptr;
+    size_t size = 0;
+};
+
+/* Caller-supplied temporary storage for a fixed number of items; merges that
+ * do not fit are done in place by the template */
+template<typename T>
+class FixedBuffer
+{
+public:
+    FixedBuffer (void * scratch, size_t size) :
+        data (static_cast<T *> (scratch)), size (size) {}
+
+    T * begin ()
+        { return data; }
+
+    bool holds (size_t n) const
+        { return n <= size; }
+
+    FixedBuffer & assign (const T * start, const T * end)
+    {
+        if (holds (end - start))
+            std::copy (start, end, data);
+
+        return * this;
+    }
+
+private:
+    T * data;
+    size_t size;
+};
+
+/* The same for elements of run-time size */
+class SizedBuffer
+{
+public:
+    SizedBuffer (void * scratch, size_t scratch_bytes, size_t size) :
+        data (static_cast<char *> (scratch)), size (size),
+        n_items (scratch_bytes / size) {}
+
+    SizedIter begin ()
+        { return {data, size}; }
+
+    bool holds (size_t n) const
+        { return n <= n_items; }
+
+    SizedBuffer & assign (SizedIter start, SizedIter end)
+    {
+        if (holds (end - start))
+            memcpy (data, start.p, end.p - start.p);
+
+        return * this;
+    }
+
+private:
+    char * data;
+    size_t size;
+    size_t n_items;
+};
+
+template<typename T, typename Less, typename Buffer>
+static void sort_with (T * start, T * end, Less less, Buffer & buf)
+{
+    auto copy_to_buf = [& buf] (T * start, T * end) -> Buffer &
+        { return buf.assign (start, end); };
+
+    mergesort (start, end, less, copy_to_buf);
+}
+
+template<size_t N>
+static void sort_direct (void * items, size_t n_items, CompareFunc compare,
+                         void * context, const MergeSortAllocator * allocator)
+{
+    Item<N> * start = static_cast<Item<N> *> (items);
+    AllocBuffer<Item<N>> buf (allocator);
+
+    sort_with (start, start + n_items, ItemLess {compare, context}, buf);
+}
+
+template<size_t N>
+static void sort_fixed (void * items, size_t n_items, CompareFunc compare,
+                        void * context, void * scratch, size_t scratch_bytes)
+{
+    Item<N> * start = static_cast<Item<N> *> (items);
+    FixedBuffer<Item<N>> buf (scratch, scratch_bytes / N);
+
+    sort_with (start, start + n_items, ItemLess {compare, context}, buf);
+}
+
+/* The instantiations for each element size, indexed by size - 1 */
+
+struct Instance
+{
+    void (* sort) (void * items, size_t n_items, CompareFunc compare,
+                   void * context, const MergeSortAllocator * allocator);
+    void (* sort_fixed) (void * items, size_t n_items, CompareFunc compare,
+                         void * context, void * scratch, size_t scratch_bytes);
+};
+
+template<typename Seq>
+struct InstanceTable;
+
+template<size_t ... I>
+struct InstanceTable<std::index_sequence<I ...>>
+{
+    static constexpr Instance table[] =
+        {{sort_direct<I + 1>, sort_fixed<I + 1>} ...};
+};
+
+template<size_t ... I>
+constexpr Instance InstanceTable<std::index_sequence<I ...>>::table[];
+
+/* (a constant table, so there is no initialization order to worry about) */
+typedef InstanceTable<std::make_index_sequence<MAX_DIRECT_SIZE>> Instances;
+
+static void sort_indirect (void * items, size_t n_items, size_t size,
+                           CompareFunc compare, void * context,
+                           const MergeSortAllocator * allocator)
+{
+    char * start = static_cast<char *> (items);
+
+    /* one allocation holds the pointers and a temporary element */
+    void * mem = allocator->realloc (nullptr, n_items * sizeof (char *) + size,
+                                     allocator->context);
+    if (! mem)
+        abort ();
+
+    void * * ptrs = static_cast<void * *> (mem);
+
+    for (size_t i = 0; i < n_items; i ++)
+        ptrs[i] = start + i * size;
+
+    /* the buffer is released before the pointers */
+    {
+        AllocBuffer<void *> buf (allocator);
+        sort_with (ptrs, ptrs + n_items, IndirectLess {compare, context}, buf);
+    }
+
+    mergesort_permute_items (items, n_items, size, ptrs, ptrs + n_items);
+
+    allocator->free (mem, allocator->context);
+}
+
+/* Same as sort_indirect(), but with the pointers, a temporary element and
+ * temporary storage for the template all taken from the scratch buffer.
+ * Returns false if they do not all fit. */
+static bool sort_indirect_fixed (void * items, size_t n_items, size_t size,
+                                 CompareFunc compare, void * context,
+                                 void * scratch, size_t scratch_bytes)
+{
+    char * start = static_cast<char *> (items);
+    char * mem = static_cast<char *> (scratch);
+
+    /* the pointers come first (the buffer is aligned by the caller), then
+     * storage for half as many, and the temporary element last */
+    size_t n_temp = n_items / 2;
+    size_t used = (n_items + n_temp) * sizeof (void *) + size;
+
+    if (scratch_bytes < used)
+        return false;
+
+    void * * ptrs = reinterpret_cast<void * *> (mem);
+    char * temp = mem + scratch_bytes - size;
+
+    for (size_t i = 0; i < n_items; i ++)
+        ptrs[i] = start + i * size;
+
+    FixedBuffer<void *> buf (ptrs + n_items, n_temp);
+    sort_with (ptrs, ptrs + n_items, IndirectLess {compare, context}, buf);
+
+    mergesort_permute_items (items, n_items, size, ptrs, temp);
+    return true;
+}
+
+/* Sorts the elements directly, moving them as blocks of bytes, with whatever
+ * of the scratch buffer there is */
+static void sort_sized_fixed (void * items, size_t n_items, size_t size,
+                              CompareFunc compare, void * context,
+                              void * scratch, size_t scratch_bytes)
+{
+    SizedIter start = {static_cast<char *> (items), size};
+    SizedBuffer buf (scratch, scratch_bytes, size);
+
+    auto copy_to_buf = [& buf] (SizedIter start, SizedIter end) -> SizedBuffer &
+        { return buf.assign (start, end); };
+
+    mergesort (start, start + n_items, IndirectLess {compare, context},
+               copy_to_buf, RuntimeSize ());
+}
+
+/* Default allocator, using the C library */
+
+static void * libc_realloc (void * ptr, size_t size, void *)
+{
+    return realloc (ptr, size);
+}
+
+static void libc_free (void * ptr, void *)
+{
+    free (ptr);
+}
+
+static const MergeSortAllocator libc_allocator = {
+    libc_realloc, libc_free, nullptr
+};
+
+extern "C" void mergesort_with_allocator (void * items, size_t n_items,
+                                          size_t size, CompareFunc compare,
+                                          void * context,
+                                          const MergeSortAllocator * allocator)
+{
+    /* A list with 0 or 1 element (or of empty elements) is sorted by
+     * definition. */
+    if (n_items < 2 || ! size)
+        return;
+
+    if (! allocator)
+        allocator = & libc_allocator;
+
+    if (size <= MAX_DIRECT_SIZE)
+        Instances::table[size - 1].sort (items, n_items, compare, context,
+                                         allocator);
+    else
+        sort_indirect (items, n_items, size, compare, context, allocator);
+}
+
+extern "C" void mergesort_with_buffer (void * items, size_t n_items,
+                                       size_t size, CompareFunc compare,
+                                       void * context, void * scratch,
+                                       size_t scratch_bytes)
+{
+    if (n_items < 2 || ! size)
+        return;
+
+    scratch = mergesort_align_scratch (scratch, & scratch_bytes);
+
+    if (size <= MAX_DIRECT_SIZE)
+        Instances::table[size - 1].sort_fixed (items, n_items, compare,
+                                               context, scratch, scratch_bytes);
+    else if (! sort_indirect_fixed (items, n_items, size, compare, context,
+                                    scratch, scratch_bytes))
+        sort_sized_fixed (items, n_items, size, compare, context, scratch,
+                          scratch_bytes);
+}
+
+extern "C" size_t mergesort_scratch_size (size_t n_items, size_t size)
+{
+    /* As in mergesort.c, only the shorter list of each merge is copied.  For
+     * elements of more than MAX_DIRECT_SIZE bytes, this is not always enough
+     * for the array of pointers as well, but the elements can then be merged
+     * directly.  Room to align the start of the buffer is added. */
+    size_t bytes = (n_items / 2) * size;
+    return bytes ? bytes + MERGESORT_ALIGN - 1 : 0;
+}
+
+extern "C" void mergesort64 (void * items, size_t n_items, size_t size,
+                             CompareFunc compare, void * context)
+{
+    mergesort_with_allocator (items, n_items, size, compare, context, nullptr);
+}
+
+extern "C" void mergesort (void * items, int n_items, int size,
+                           CompareFunc compare, void * context)
+{
+    if (n_items < 2 || ! size)
+        return;
+
+    mergesort64 (items, n_items, size, compare, context);
+}
@@ -0,0 +1,842 @@
+/*
+ * Adaptive Merge Sort
+ * Copyright 2017 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * Type-specialized versions of the merge-sort algorithm in mergesort.c
+ *
+ *   MERGESORT_DEFINE (name, type, less_expr)
+ *
+ * defines a function
+ *
+ *   static void name (type * items, size_t n_items);
+ *
+ * which sorts the items stably in ascending order.  less_expr is an
+ * expression in terms of "a" and "b" (both "const type *") which is true if
+ * "* a" should be sorted before "* b", for example:
+ *
+ *   MERGESORT_DEFINE (sort_ints, int, * a < * b)
+ *
+ * Complex types (e.g. pointers) should be given via a typedef.
+ *
+ * Since the comparison is inlined and elements are moved by copies of a
+ * constant size, this avoids the indirect function calls and the generic
+ * memcpy() code paths of mergesort().  The algorithm is otherwise exactly the
+ * same: both are expanded from MERGESORT_ENGINE below, which mergesort.c
+ * also uses.  Temporary storage is allocated with realloc(); if that fails,
+ * the program is aborted.
+ */
+
+#ifndef MERGESORT_DEFINE_H
+#define MERGESORT_DEFINE_H
+
+#include "mergesort.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Hook for testing: if MERGESORT_STACK is defined at compile time as the name
+ * of a function with this signature, it is called each time a new run
+ * [head, div[n_div - 1]) has been pushed onto the stack of runs. */
+#ifdef MERGESORT_STACK
+#ifdef __cplusplus
+extern "C"
+#endif
+void MERGESORT_STACK (void * head, void * const * div, int n_div);
+#define MERGESORT_PUSHED(head, div, n_div) MERGESORT_STACK (head, div, n_div)
+#else
+#define MERGESORT_PUSHED(head, div, n_div) ((void) 0)
+#endif
+
+/* Temporary storage, grown as needed through the allocator.  If there is no
+ * allocator, the storage is a fixed buffer supplied by the caller. */
+
+typedef struct {
+    void * data;
+    size_t size;
+    const MergeSortAllocator * allocator;
+} MergeSortBuffer;
+
+static inline void * mergesort_libc_realloc (void * ptr, size_t size,
+                                             void * context)
+{
+    return realloc (ptr, size);
+}
+
+static inline void mergesort_libc_free (void * ptr, void * context)
+{
+    free (ptr);
+}
+
+static inline void * mergesort_checked_realloc
+ (const MergeSortAllocator * allocator, void * ptr, size_t size)
+{
+    void * data = allocator->realloc (ptr, size, allocator->context);
+
+    /* there is no way to report failure to the caller */
+    if (! data)
+        abort ();
+
+    return data;
+}
+
+/* Alignment of the most strictly aligned types (C99 has no max_align_t) */
+
+typedef union {
+    long double d;
+    long long l;
+    void * p;
+    void (* f) (void);
+} MergeSortMaxAlign;
+
+typedef struct {
+    char c;
+    MergeSortMaxAlign a;
+} MergeSortAlignProbe;
+
+#define MERGESORT_ALIGN offsetof (MergeSortAlignProbe, a)
+
+/* Rounds the start of a caller-supplied scratch buffer up to MERGESORT_ALIGN,
+ * so that elements copied into it are aligned, and shrinks its size to match */
+static inline void * mergesort_align_scratch (void * scratch, size_t * bytes)
+{
+    size_t skip = (MERGESORT_ALIGN - (uintptr_t) scratch % MERGESORT_ALIGN) %
+                  MERGESORT_ALIGN;
+
+    if (* bytes <= skip)
+    {
+        * bytes = 0;
+        return scratch;
+    }
+
+    * bytes -= skip;
+    return (char *) scratch + skip;
+}
+
+/* Returns storage of at least the given size, or NULL if the buffer is fixed
+ * and too small */
+static inline void * mergesort_reserve (MergeSortBuffer * buf, size_t size)
+{
+    if (buf->size < size)
+    {
+        if (! buf->allocator)
+            return NULL;
+
+        buf->data = mergesort_checked_realloc (buf->allocator, buf->data, size);
+        buf->size = size;
+    }
+
+    return buf->data;
+}
+
+/* Exchanges two non-overlapping elements byte by byte */
+static inline void mergesort_swap_items (char * a, char * b, size_t size)
+{
+    for (size_t i = 0; i < size; i ++)
+    {
+        char temp = a[i];
+        a[i] = b[i];
+        b[i] = temp;
+    }
+}
+
+/* Reverses the order of the elements in [start, end) */
+static inline void mergesort_reverse (char * start, char * end, size_t size)
+{
+    for (end -= size; start < end; start += size, end -= size)
+        mergesort_swap_items (start, end, size);
+}
+
+/* Exchanges the adjacent blocks [head, mid) and [mid, tail).  The shorter
+ * block is moved through temporary storage if it fits; otherwise the blocks
+ * are exchanged in place by three reversals. */
+static inline void mergesort_rotate (char * head, char * mid, char * tail,
+                                     size_t size, MergeSortBuffer * buf)
+{
+    size_t a_bytes = mid - head;
+    size_t b_bytes = tail - mid;
+    void * temp;
+
+    if (! a_bytes || ! b_bytes)
+        return;
+
+    if (a_bytes <= b_bytes && (temp = mergesort_reserve (buf, a_bytes)))
+    {
+        memcpy (temp, head, a_bytes);
+        memmove (head, mid, b_bytes);
+        memcpy (head + b_bytes, temp, a_bytes);
+    }
+    else if (b_bytes < a_bytes && (temp = mergesort_reserve (buf, b_bytes)))
+    {
+        memcpy (temp, mid, b_bytes);
+        memmove (head + b_bytes, head, a_bytes);
+        memcpy (head, temp, b_bytes);
+    }
+    else
+    {
+        mergesort_reverse (head, mid, size);
+        mergesort_reverse (mid, tail, size);
+        mergesort_reverse (head, tail, size);
+    }
+}
+
+/* Moves the elements into the order given by a sorted array of pointers to
+ * them, following each cycle of the permutation in turn.  Each element is
+ * copied once, plus one extra copy (through temp) per cycle.  (This is used to
+ * sort large elements indirectly, by sorting the pointers.) */
+static inline void mergesort_permute_items (void * items, size_t n_items,
+                                            size_t size, void * * ptrs,
+                                            void * temp)
+{
+    for (size_t i = 0; i < n_items; i ++)
+    {
+        char * start = (char *) items + i * size;
+        char * dest = start;
+        size_t j = i;
+
+        if (ptrs[i] == start)
+            continue;
+
+        memcpy (temp, start, size);
+
+        while (ptrs[j] != start)
+        {
+            char * src = (char *) ptrs[j];
+
+            memcpy (dest, src, size);
+            ptrs[j] = dest;  /* mark as done */
+
+            dest = src;
+            j = (src - (char *) items) / size;
+        }
+
+        memcpy (dest, temp, size);
+        ptrs[j] = dest;
+    }
+}
+
+/* The merge loops take one element at a time, until one list has "won"
+ * MERGESORT_GALLOP_MIN times in a row. */
+
+#define MERGESORT_GALLOP_MIN 7
+
+/*
+ * The merge-sort algorithm itself:
+ *
+ *   MERGESORT_ENGINE (name, item_size, less)
+ *
+ * defines (among others) the function
+ *
+ *   static void name_sort (char * items, size_t n_items, size_t size,
+ *                          CompareFunc compare, void * context,
+ *                          MergeSortBuffer * buf);
+ *
+ * item_size is an expression giving the element size in bytes: either "size"
+ * (the parameter) or a constant.  With a constant, the compiler turns each
+ * memcpy() of an element into a few fixed-size (vector) loads and stores
+ * instead of a library call; MERGESORT_SORTS below expands the engine once
+ * for each common size and chooses among them once per sort.  less is the
+ * name of a function
+ *
+ *   int less (const char * a, const char * b, CompareFunc compare,
+ *             void * context);
+ *
+ * returning true if "a" should be sorted before "b"; compare and context are
+ * those passed to name_sort(), and need not be used.
+ *
+ * This algorithm borrows some ideas from TimSort but is not quite as
+ * sophisticated.  Runs are detected, but only in the forward direction, and
+ * the invariant is stricter: each stored run must be no more than half the
+ * length of the previous.
+ */
+
+#define MERGESORT_ENGINE(name, item_size, less) \
+\
+/* True if element x sorts before the key: if it is less (upper = 0), or if it \
+ * is not greater (upper = 1) */ \
+\
+static inline int name##_before (const char * x, const char * key, int upper, \
+                                 CompareFunc compare, void * context) \
+{ \
+    return upper ? ! less (key, x, compare, context) \
+                 : less (x, key, compare, context); \
+} \
+\
+/* Binary search within a sorted list for the first element that does not \
+ * sort before the key: with upper = 0 the result is the first element not \
+ * less than the key (lower bound), with 1 the first element greater than the \
+ * key (upper bound). */ \
+\
+static inline char * name##_search (char * start, char * end, \
+                                    const char * key, int upper, size_t size, \
+                                    CompareFunc compare, void * context) \
+{ \
+    size_t n = (end - start) / (item_size); \
+\
+    while (n > 0) \
+    { \
+        char * half = start + (n / 2) * (item_size); \
+\
+        if (name##_before (half, key, upper, compare, context)) { \
+            start = half + (item_size); \
+            n -= n / 2 + 1; \
+        } else \
+            n /= 2; \
+    } \
+\
+    return start; \
+} \
+\
+/* Same as search(), but first probes 1, 2, 4, 8, ... elements from the start \
+ * of the list, so that the cost is logarithmic in the distance to the result \
+ * rather than in the length of the list ("galloping") */ \
+\
+static inline char * name##_gallop (char * start, char * end, \
+                                    const char * key, int upper, size_t size, \
+                                    CompareFunc compare, void * context) \
+{ \
+    size_t n = (end - start) / (item_size); \
+    size_t prev = 0, ofs = 1; \
+\
+    /* the first "prev" elements sort before the key */ \
+    while (ofs <= n && name##_before (start + (ofs - 1) * (item_size), key, \
+                                      upper, compare, context)) \
+    { \
+        prev = ofs; \
+        ofs *= 2; \
+    } \
+\
+    if (ofs <= n) \
+        end = start + (ofs - 1) * (item_size); \
+\
+    return name##_search (start + prev * (item_size), end, key, upper, size, \
+                          compare, context); \
+} \
+\
+/* Same as gallop(), but probes from the end of the list */ \
+\
+static inline char * name##_gallop_back (char * start, char * end, \
+                                         const char * key, int upper, \
+                                         size_t size, CompareFunc compare, \
+                                         void * context) \
+{ \
+    size_t n = (end - start) / (item_size); \
+    size_t prev = 0, ofs = 1; \
+\
+    /* the last "prev" elements do not sort before the key */ \
+    while (ofs <= n && ! name##_before (end - ofs * (item_size), key, upper, \
+                                        compare, context)) \
+    { \
+        prev = ofs; \
+        ofs *= 2; \
+    } \
+\
+    if (ofs <= n) \
+        start = end - (ofs - 1) * (item_size); \
+\
+    return name##_search (start, end - prev * (item_size), key, upper, size, \
+                          compare, context); \
+} \
+\
+/* Inserts a single element into a sorted list */ \
+\
+static inline void name##_insert_head (char * head, char * tail, size_t size, \
+                                       CompareFunc compare, void * context, \
+                                       MergeSortBuffer * buf) \
+{ \
+    /* up to 128 bytes, aligned for any type */ \
+    union { uint64_t words[16]; long double ld; void * ptr; } temp_buf; \
+    char * temp = (char *) & temp_buf; \
+    char * dest; \
+\
+    /* generic version, for large elements */ \
+    if ((item_size) > sizeof temp_buf) \
+    { \
+        for (dest = head + (item_size); dest + (item_size) < tail; \
+             dest += (item_size)) \
+        { \
+            if (! less (dest + (item_size), head, compare, context)) \
+                break; \
+        } \
+\
+        mergesort_rotate (head, head + (item_size), dest + (item_size), \
+                          (item_size), buf); \
+        return; \
+    } \
+\
+    memcpy (temp, head, (item_size)); \
+    memcpy (head, head + (item_size), (item_size)); \
+\
+    for (dest = head + (item_size); dest + (item_size) < tail; \
+         dest += (item_size)) \
+    { \
+        if (! less (dest + (item_size), temp, compare, context)) \
+            break; \
+\
+        memcpy (dest, dest + (item_size), (item_size)); \
+    } \
+\
+    memcpy (dest, temp, (item_size)); \
+} \
+\
+/* Merges [head, mid) and [mid, tail), with list "a" copied to temp, working \
+ * left-to-right */ \
+\
+static inline void name##_merge_lo (char * head, char * mid, char * tail, \
+                                    char * temp, size_t size, \
+                                    CompareFunc compare, void * context) \
+{ \
+    char * a = temp; \
+    char * a_end = temp + (mid - head); \
+    char * b = mid; \
+    char * dest = head; \
+    size_t a_wins, b_wins; \
+    size_t min_gallop = MERGESORT_GALLOP_MIN; \
+\
+    while (a < a_end && b < tail) \
+    { \
+        a_wins = b_wins = 0; \
+\
+        while (a < a_end && b < tail) \
+        { \
+            if (! less (b, a, compare, context)) \
+            { \
+                memcpy (dest, a, (item_size)); \
+                dest += (item_size); \
+                a += (item_size); \
+                b_wins = 0; \
+                if (++ a_wins == min_gallop) \
+                    break; \
+            } \
+            else \
+            { \
+                memcpy (dest, b, (item_size)); \
+                dest += (item_size); \
+                b += (item_size); \
+                a_wins = 0; \
+                if (++ b_wins == min_gallop) \
+                    break; \
+            } \
+        } \
+\
+        /* Gallop: while either list keeps winning, copy whole blocks found by \
+         * exponential search instead of comparing one element at a time. */ \
+        while (a < a_end && b < tail) \
+        { \
+            char * a_stop = name##_gallop (a, a_end, b, 1, size, compare, \
+                                           context); \
+            a_wins = (a_stop - a) / (item_size); \
+            memcpy (dest, a, a_stop - a); \
+            dest += a_stop - a; \
+            a = a_stop; \
+\
+            if (a == a_end) \
+                break; \
+\
+            char * b_stop = name##_gallop (b, tail, a, 0, size, compare, \
+                                           context); \
+            b_wins = (b_stop - b) / (item_size); \
+            memmove (dest, b, b_stop - b); \
+            dest += b_stop - b; \
+            b = b_stop; \
+\
+            if (a_wins < MERGESORT_GALLOP_MIN && \
+                b_wins < MERGESORT_GALLOP_MIN) \
+            { \
+                /* galloping did not pay off; make it harder to start again */ \
+                min_gallop ++; \
+                break; \
+            } \
+\
+            if (min_gallop > 1) \
+                min_gallop --; \
+        } \
+    } \
+\
+    /* copy remainder of list "a" (any remainder of "b" is already in \
+     * place) */ \
+    if (a < a_end) \
+        memcpy (dest, a, a_end - a); \
+} \
+\
+/* Merges [head, mid) and [mid, tail), with list "b" copied to temp, working \
+ * right-to-left */ \
+\
+static inline void name##_merge_hi (char * head, char * mid, char * tail, \
+                                    char * temp, size_t size, \
+                                    CompareFunc compare, void * context) \
+{ \
+    char * a = mid; \
+    char * b = temp + (tail - mid); \
+    char * dest = tail; \
+    size_t a_wins, b_wins; \
+    size_t min_gallop = MERGESORT_GALLOP_MIN; \
+\
+    while (a > head && b > temp) \
+    { \
+        a_wins = b_wins = 0; \
+\
+        while (a > head && b > temp) \
+        { \
+            if (less (b - (item_size), a - (item_size), compare, context)) \
+            { \
+                dest -= (item_size); \
+                a -= (item_size); \
+                memcpy (dest, a, (item_size)); \
+                b_wins = 0; \
+                if (++ a_wins == min_gallop) \
+                    break; \
+            } \
+            else \
+            { \
+                dest -= (item_size); \
+                b -= (item_size); \
+                memcpy (dest, b, (item_size)); \
+                a_wins = 0; \
+                if (++ b_wins == min_gallop) \
+                    break; \
+            } \
+        } \
+\
+        /* gallop, as in merge_lo() */ \
+        while (a > head && b > temp) \
+        { \
+            char * a_stop = name##_gallop_back (head, a, b - (item_size), 1, \
+                                                size, compare, context); \
+            a_wins = (a - a_stop) / (item_size); \
+            dest -= a - a_stop; \
+            memmove (dest, a_stop, a - a_stop); \
+            a = a_stop; \
+\
+            if (a == head) \
+                break; \
+\
+            char * b_stop = name##_gallop_back (temp, b, a - (item_size), 0, \
+                                                size, compare, context); \
+            b_wins = (b - b_stop) / (item_size); \
+            dest -= b - b_stop; \
+            memcpy (dest, b_stop, b - b_stop); \
+            b = b_stop; \
+\
+            if (a_wins < MERGESORT_GALLOP_MIN && \
+                b_wins < MERGESORT_GALLOP_MIN) \
+            { \
+                /* galloping did not pay off; make it harder to start again */ \
+                min_gallop ++; \
+                break; \
+            } \
+\
+            if (min_gallop > 1) \
+                min_gallop --; \
+        } \
+    } \
+\
+    /* copy remainder of list "b" (any remainder of "a" is already in \
+     * place) */ \
+    if (b > temp) \
+        memcpy (head, temp, b - temp); \
+} \
+\
+static inline void name##_merge_in_place (char * head, char * mid, \
+                                          char * tail, size_t size, \
+                                          CompareFunc compare, void * context, \
+                                          MergeSortBuffer * buf); \
+\
+/* Merges two sorted sub-lists */ \
+\
+static inline void name##_merge (char * head, char * mid, char * tail, \
+                                 size_t size, CompareFunc compare, \
+                                 void * context, MergeSortBuffer * buf) \
+{ \
+    /* Trim the elements that are already in place: those at the start of \
+     * list "a" that are not greater than the first element of "b", and those \
+     * at the end of "b" that are not less than the last element of "a". */ \
+    head = name##_gallop (head, mid, mid, 1, size, compare, context); \
+    if (head == mid) \
+        return; \
+\
+    tail = name##_gallop_back (mid, tail, mid - (item_size), 0, size, compare, \
+                               context); \
+\
+    /* Handle the case of strictly separate (but reversed) lists specially. \
+     * In this case, we simply exchange the two lists. */ \
+    if (less (tail - (item_size), head, compare, context)) \
+    { \
+        mergesort_rotate (head, mid, tail, (item_size), buf); \
+        return; \
+    } \
+\
+    /* copy the shorter list to temporary storage */ \
+    size_t a_bytes = mid - head; \
+    size_t b_bytes = tail - mid; \
+    size_t bytes = (a_bytes <= b_bytes) ? a_bytes : b_bytes; \
+    char * temp = (char *) mergesort_reserve (buf, bytes); \
+\
+    /* not enough storage in a caller-supplied buffer */ \
+    if (! temp) \
+        name##_merge_in_place (head, mid, tail, size, compare, context, buf); \
+    else if (a_bytes <= b_bytes) \
+    { \
+        memcpy (temp, head, a_bytes); \
+        name##_merge_lo (head, mid, tail, temp, size, compare, context); \
+    } \
+    else \
+    { \
+        memcpy (temp, mid, b_bytes); \
+        name##_merge_hi (head, mid, tail, temp, size, compare, context); \
+    } \
+} \
+\
+/* Merges two sorted sub-lists when neither fits in temporary storage. \
+ * The longer list is split in half, and the matching split point in the \
+ * other list is found by binary search.  Exchanging the middle two blocks \
+ * leaves two smaller merges, which are handed back to merge() (so that they \
+ * use the temporary storage once they fit in it). */ \
+\
+static inline void name##_merge_in_place (char * head, char * mid, \
+                                          char * tail, size_t size, \
+                                          CompareFunc compare, void * context, \
+                                          MergeSortBuffer * buf) \
+{ \
+    size_t n_a = (mid - head) / (item_size); \
+    size_t n_b = (tail - mid) / (item_size); \
+    char * cut_a, * cut_b; \
+\
+    if (n_a == 1 && n_b == 1) \
+    { \
+        if (less (mid, head, compare, context)) \
+            mergesort_swap_items (head, mid, (item_size)); \
+\
+        return; \
+    } \
+\
+    if (n_a > n_b) { \
+        cut_a = head + (n_a / 2) * (item_size); \
+        cut_b = name##_search (mid, tail, cut_a, 0, size, compare, context); \
+    } else { \
+        cut_b = mid + (n_b / 2) * (item_size); \
+        cut_a = name##_search (head, mid, cut_b, 1, size, compare, context); \
+    } \
+\
+    mergesort_rotate (cut_a, mid, cut_b, (item_size), buf); \
+\
+    char * new_mid = cut_a + (cut_b - mid); \
+\
+    if (head < cut_a && cut_a < new_mid) \
+        name##_merge (head, cut_a, new_mid, size, compare, context, buf); \
+    if (new_mid < cut_b && cut_b < tail) \
+        name##_merge (new_mid, cut_b, tail, size, compare, context, buf); \
+} \
+\
+/* Top-level merge sort algorithm */ \
+\
+static inline void name##_sort (char * items, size_t n_items, size_t size, \
+                                CompareFunc compare, void * context, \
+                                MergeSortBuffer * buf) \
+{ \
+    /* The algorithm runs right-to-left (so that insertions are \
+     * left-to-right). */ \
+    char * head = items + n_items * (item_size); \
+    char * mid, * tail, * tail2; \
+\
+    /* Markers recording the divisions between sorted sub-lists or "runs". \
+     * Each run is at least 2x the length of its left-hand neighbor, so in \
+     * theory a list of 2^64 - 1 elements will have no more than 64 runs. */ \
+    void * div[64]; \
+    int n_div = 0; \
+\
+    do \
+    { \
+        mid = head; \
+        head = mid - (item_size); \
+\
+        /* Scan right-to-left to find a run of increasing values. \
+         * If necessary, use insertion sort to create a run at 4 values long. \
+         * At this scale, insertion sort is faster due to lower overhead. */ \
+        while (head > items) \
+        { \
+            if (less (head, head - (item_size), compare, context)) \
+            { \
+                if ((size_t) (mid - head) < 4 * (item_size)) \
+                    name##_insert_head (head - (item_size), mid, size, \
+                                        compare, context, buf); \
+                else \
+                    break; \
+            } \
+\
+            head -= (item_size); \
+        } \
+\
+        /* Merge/collapse sub-lists left-to-right to maintain the \
+         * invariant. */ \
+        while (n_div >= 1) \
+        { \
+            tail = (char *) div[n_div - 1]; \
+\
+            while (n_div >= 2) \
+            { \
+                tail2 = (char *) div[n_div - 2]; \
+\
+                /* \
+                 * Check for the occasional case where the new sub-list is \
+                 * longer than both the two previous.  In this case, a "3-way" \
+                 * merge is performed as follows: \
+                 * \
+                 *   |---------- #6 ----------|- #5 -|---- #4 ----| ... \
+                 * \
+                 * First, the two previous sub-lists (#5 and #4) are merged. \
+                 * (This is more balanced and therefore more efficient than \
+                 * merging the long #6 with the short #5.) \
+                 * \
+                 *   |---------- #5 ----------|-------- #4 -------| ... \
+                 * \
+                 * The invariant guarantees that the newly merged sub-list \
+                 * (#4) will be shorter than its right-hand neighbor (#3). \
+                 * \
+                 * At this point we loop, and one of two things can happen: \
+                 * \
+                 *  1) If sub-list #5 is no longer than #3, we drop out of the \
+                 *     loop.  #5 is still longer than half of #4, so a 2-way \
+                 *     merge will be required to restore the invariant. \
+                 * \
+                 *  2) If #5 is longer than even #3 (rare), we perform another \
+                 *     3-way merge, starting with #4 and #3.  The same result \
+                 *     holds true: the newly merged #3 will again be shorter \
+                 *     than its right-hand neighbour (#2).  In this fashion \
+                 *     the process can be continued down the line with no \
+                 *     more than two sub-lists violating the invariant at any \
+                 *     given time.  Eventually no more 3-way merges can be \
+                 *     performed, and the invariant is restored by a final \
+                 *     2-way merge. \
+                 */ \
+\
+                if ((mid - head) <= (tail2 - tail)) \
+                    break; \
+\
+                name##_merge (mid, tail, tail2, size, compare, context, buf); \
+\
+                tail = tail2; \
+                n_div --; \
+            } \
+\
+            /* \
+             * Otherwise, check whether the new sub-list is longer than half \
+             * its right-hand neighbour.  If so, merge the two sub-lists.  The \
+             * merged sub-list may in turn be longer than its own right-hand \
+             * neighbor, and if so the entire process is repeated. \
+             * \
+             * Once the "head" pointer reaches the beginning of the original \
+             * list, we simply keep merging until only one sub-list remains. \
+             */ \
+\
+            if (head > items && (mid - head) <= (tail - mid) / 2) \
+                break; \
+\
+            name##_merge (head, mid, tail, size, compare, context, buf); \
+\
+            mid = tail; \
+            n_div --; \
+        } \
+\
+        /* push the new sub-list onto the stack */ \
+        div[n_div] = mid; \
+        n_div ++; \
+\
+        MERGESORT_PUSHED (head, div, n_div); \
+    } \
+    while (head > items); \
+}
+
+/*
+ * The engine expanded once for each common element size, and once more for
+ * any other size:
+ *
+ *   MERGESORT_SORTS (name, less)
+ *
+ * defines name_sort() with the same parameters as above, which calls the
+ * expansion for the element size.  The choice is made once per sort, so that
+ * the inner loops all work with a constant size.
+ */
+
+#define MERGESORT_SORTS(name, less) \
+\
+MERGESORT_ENGINE (name##_4, 4, less) \
+MERGESORT_ENGINE (name##_8, 8, less) \
+MERGESORT_ENGINE (name##_12, 12, less) \
+MERGESORT_ENGINE (name##_16, 16, less) \
+MERGESORT_ENGINE (name##_24, 24, less) \
+MERGESORT_ENGINE (name##_32, 32, less) \
+MERGESORT_ENGINE (name##_64, 64, less) \
+MERGESORT_ENGINE (name##_128, 128, less) \
+MERGESORT_ENGINE (name##_any, size, less) \
+\
+static inline void name##_sort (char * items, size_t n_items, size_t size, \
+                                CompareFunc compare, void * context, \
+                                MergeSortBuffer * buf) \
+{ \
+    void (* sort) (char * items, size_t n_items, size_t size, \
+                   CompareFunc compare, void * context, \
+                   MergeSortBuffer * buf); \
+\
+    switch (size) \
+    { \
+    case 4: sort = name##_4_sort; break; \
+    case 8: sort = name##_8_sort; break; \
+    case 12: sort = name##_12_sort; break; \
+    case 16: sort = name##_16_sort; break; \
+    case 24: sort = name##_24_sort; break; \
+    case 32: sort = name##_32_sort; break; \
+    case 64: sort = name##_64_sort; break; \
+    case 128: sort = name##_128_sort; break; \
+    default: sort = name##_any_sort; break; \
+    } \
+\
+    sort (items, n_items, size, compare, context, buf); \
+}
+
+#define MERGESORT_DEFINE(name, type, less_expr) \
+\
+static inline int name##_less (const char * a_, const char * b_, \
+                               CompareFunc compare, void * context) \
+{ \
+    const type * a = (const type *) a_; \
+    const type * b = (const type *) b_; \
+\
+    return (less_expr); \
+} \
+\
+MERGESORT_ENGINE (name##_engine, sizeof (type), name##_less) \
+\
+static inline void name (type * items, size_t n_items) \
+{ \
+    MergeSortAllocator allocator = {mergesort_libc_realloc, \
+                                    mergesort_libc_free, NULL}; \
+    MergeSortBuffer buf = {NULL, 0, & allocator}; \
+\
+    if (n_items < 2) \
+        return; \
+\
+    name##_engine_sort ((char *) items, n_items, sizeof (type), NULL, NULL, \
+                        & buf); \
+\
+    free (buf.data); \
+}
+
+#endif
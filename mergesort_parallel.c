@@ -0,0 +1,297 @@
+/*
+ * Adaptive Merge Sort
+ * Copyright 2017 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/*
+ * Parallel version of the merge-sort algorithm, using POSIX threads
+ *
+ * The list is cut into one chunk per thread, and the chunks are sorted
+ * concurrently by mergesort64().  The sorted chunks are then merged pairwise,
+ * in rounds, between the list and a temporary copy of the same size.  Each
+ * merge is itself split among threads: the output is cut into pieces of
+ * roughly equal length, and the inputs of each piece are found by binary
+ * search along the "merge path" (see co_rank() below), so that every piece can
+ * be merged independently.  Ties always go to the left-hand chunk, which keeps
+ * the sort stable.
+ */
+
+#define _POSIX_C_SOURCE 200809L  /* for sysconf */
+
+#include "mergesort.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Below this many items per thread, threads cost more than they save. */
+#define MIN_ITEMS_PER_THREAD 16384
+
+/* Upper bound on the number of threads (and so on the number of tasks in one
+ * round), so that the task list can live on the stack */
+#define MAX_THREADS 256
+
+/* One unit of work: either sorting a chunk in place (b == NULL), or merging
+ * [a, a_end) and [b, b_end) into dest.  A merge with an empty list "b" is a
+ * plain copy. */
+typedef struct {
+    void * dest;
+    void * a, * a_end;
+    void * b, * b_end;
+} Task;
+
+typedef struct {
+    Task * tasks;
+    int n_tasks;
+    int n_threads;
+    int thread;
+    size_t size;
+    CompareFunc compare;
+    void * context;
+} Worker;
+
+#define MERGE_INTO(n) \
+    do { \
+        while (a < a_end && b < b_end) \
+        { \
+            if (compare (a, b, context) < 1) { \
+                memcpy (dest, a, n); \
+                a += n; \
+            } else { \
+                memcpy (dest, b, n); \
+                b += n; \
+            } \
+\
+            dest += n; \
+        } \
+    } while (0)
+
+/* Stable out-of-place merge of two sorted lists */
+
+static void merge_into (void * dest, void * a, void * a_end,
+                        void * b, void * b_end,
+                        size_t size, CompareFunc compare, void * context)
+{
+    switch (size)
+    {
+    case 4: MERGE_INTO (4); break;
+    case 8: MERGE_INTO (8); break;
+    case 16: MERGE_INTO (16); break;
+    default: MERGE_INTO (size); break;
+    }
+
+    /* copy remainder of either list */
+    memcpy (dest, a, a_end - a);
+    dest += a_end - a;
+    memcpy (dest, b, b_end - b);
+}
+
+/* Returns the number of items taken from list "a" when the first k items of
+ * the stable merge of "a" (n_a items) and "b" (n_b items) have been output */
+
+static size_t co_rank (size_t k, void * a, size_t n_a, void * b, size_t n_b,
+                       size_t size, CompareFunc compare, void * context)
+{
+    size_t lo = (k > n_b) ? k - n_b : 0;
+    size_t hi = (k < n_a) ? k : n_a;
+
+    while (lo < hi)
+    {
+        size_t i = lo + (hi - lo) / 2;
+        size_t j = k - i;
+
+        /* if a[i] is output before b[j - 1], more of "a" is needed */
+        if (compare (a + i * size, b + (j - 1) * size, context) <= 0)
+            lo = i + 1;
+        else
+            hi = i;
+    }
+
+    return lo;
+}
+
+static void * run_worker (void * data)
+{
+    Worker * w = data;
+
+    for (int i = w->thread; i < w->n_tasks; i += w->n_threads)
+    {
+        Task * t = & w->tasks[i];
+
+        if (t->b)
+            merge_into (t->dest, t->a, t->a_end, t->b, t->b_end,
+                        w->size, w->compare, w->context);
+        else
+            mergesort64 (t->a, (t->a_end - t->a) / w->size, w->size,
+                         w->compare, w->context);
+    }
+
+    return NULL;
+}
+
+/* Runs the tasks on n_threads threads (including the calling thread).  If a
+ * thread cannot be created, its share of the tasks is run by the calling
+ * thread instead. */
+
+static void run_tasks (Task * tasks, int n_tasks, int n_threads,
+                       size_t size, CompareFunc compare, void * context)
+{
+    pthread_t threads[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    int created[MAX_THREADS];
+
+    if (n_threads > n_tasks)
+        n_threads = n_tasks;
+
+    for (int i = 0; i < n_threads; i ++)
+    {
+        workers[i] = (Worker) {tasks, n_tasks, n_threads, i, size, compare, context};
+        created[i] = (i > 0 && ! pthread_create (& threads[i], NULL, run_worker, & workers[i]));
+    }
+
+    for (int i = 0; i < n_threads; i ++)
+    {
+        if (! created[i])
+            run_worker (& workers[i]);
+    }
+
+    for (int i = 1; i < n_threads; i ++)
+    {
+        if (created[i])
+            pthread_join (threads[i], NULL);
+    }
+}
+
+void mergesort_parallel (void * items, size_t n_items, size_t size,
+                         CompareFunc compare, void * context, int n_threads)
+{
+    if (n_items < 2 || ! size)
+        return;
+
+    if (n_threads < 1)
+    {
+        long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        n_threads = (n_cpus > 0) ? n_cpus : 1;
+    }
+
+    if (n_threads > MAX_THREADS)
+        n_threads = MAX_THREADS;
+    if ((size_t) n_threads > n_items / MIN_ITEMS_PER_THREAD)
+        n_threads = n_items / MIN_ITEMS_PER_THREAD;
+
+    void * temp = (n_threads > 1) ? malloc (n_items * size) : NULL;
+
+    if (! temp)
+    {
+        mergesort64 (items, n_items, size, compare, context);
+        return;
+    }
+
+    /* boundaries of the sorted runs (initially the chunks), as item indexes */
+    size_t bounds[MAX_THREADS + 1];
+    int n_runs = n_threads;
+    Task tasks[MAX_THREADS * 2];
+    int n_tasks = 0;
+
+    for (int i = 0; i <= n_runs; i ++)
+        bounds[i] = n_items * i / n_runs;
+
+    /* sort the chunks */
+    for (int i = 0; i < n_runs; i ++)
+        tasks[n_tasks ++] = (Task) {NULL, items + bounds[i] * size,
+                                    items + bounds[i + 1] * size, NULL, NULL};
+
+    run_tasks (tasks, n_tasks, n_threads, size, compare, context);
+
+    void * src = items, * dest = temp;
+
+    /* Merge pairs of runs until only one remains.  The output of each merge
+     * is cut into about n_threads * length / n_items pieces, so that each
+     * round has about n_threads pieces of equal length in total.  An unpaired
+     * run at the end is copied as it is. */
+    while (n_runs > 1)
+    {
+        n_tasks = 0;
+
+        for (int r = 0; r < n_runs; r += 2)
+        {
+            size_t start = bounds[r];
+            size_t mid = bounds[r + 1];
+            size_t end = (r + 2 <= n_runs) ? bounds[r + 2] : mid;
+
+            void * a = src + start * size;
+            void * b = src + mid * size;
+            size_t n_a = mid - start;
+            size_t n_b = end - mid;
+            size_t n_pieces = (size_t) n_threads * (end - start) / n_items;
+
+            if (n_pieces < 1)
+                n_pieces = 1;
+
+            size_t i_prev = 0;
+
+            for (size_t p = 1; p <= n_pieces; p ++)
+            {
+                size_t k_prev = (end - start) * (p - 1) / n_pieces;
+                size_t k = (end - start) * p / n_pieces;
+                size_t i = (p == n_pieces) ? n_a :
+                 co_rank (k, a, n_a, b, n_b, size, compare, context);
+
+                tasks[n_tasks ++] = (Task) {dest + (start + k_prev) * size,
+                 a + i_prev * size, a + i * size,
+                 b + (k_prev - i_prev) * size, b + (k - i) * size};
+
+                i_prev = i;
+            }
+        }
+
+        run_tasks (tasks, n_tasks, n_threads, size, compare, context);
+
+        /* drop the boundaries between merged runs */
+        for (int r = 0; r <= n_runs; r += 2)
+            bounds[r / 2] = bounds[r];
+
+        if (n_runs % 2)
+            bounds[n_runs / 2 + 1] = bounds[n_runs];
+
+        n_runs = (n_runs + 1) / 2;
+
+        void * swap = src;
+        src = dest;
+        dest = swap;
+    }
+
+    /* copy the result back, also in parallel */
+    if (src != items)
+    {
+        n_tasks = 0;
+
+        for (int i = 0; i < n_threads; i ++)
+        {
+            size_t start = n_items * i / n_threads;
+            size_t end = n_items * (i + 1) / n_threads;
+
+            tasks[n_tasks ++] = (Task) {items + start * size, src + start * size,
+                                        src + end * size, src, src};
+        }
+
+        run_tasks (tasks, n_tasks, n_threads, size, compare, context);
+    }
+
+    free (temp);
+}
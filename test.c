@@ -22,10 +22,15 @@
  */
 
 #include "mergesort.h"
+#include "mergesort_define.h"
 
+#include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <glib.h>
 
 typedef struct {
@@ -64,6 +69,148 @@ Item * gen_array (int n_items, int n_swaps, bool rev)
     return items;
 }
 
+/*
+ * Adversarial inputs, built from ascending runs of chosen lengths.  Each run
+ * starts with the lowest value and ends with the highest, so that run
+ * boundaries are exactly where intended and every merge has to compare the
+ * two sub-lists all the way through.  Note that the algorithm runs
+ * right-to-left, so the rightmost run is the first pushed onto the stack.
+ */
+Item * gen_runs (const int * lengths, int n_runs, int * n_items)
+{
+    int total = 0;
+    for (int r = 0; r < n_runs; r ++)
+        total += lengths[r];
+
+    Item * items = g_new (Item, total);
+    Item * run = items;
+
+    for (int r = 0; r < n_runs; r ++)
+    {
+        int len = lengths[r];
+
+        /* sorted random values, as a random walk spanning ~[0, 1000000] */
+        int step = 2000000 / len + 1;
+        int val = 0;
+
+        for (int i = 0; i < len; i ++)
+        {
+            val += g_random_int_range (0, step);
+            run[i].val = val;
+        }
+
+        run[0].val = 0;
+        if (len > 1)
+            run[len - 1].val = 3000000;
+
+        run += len;
+    }
+
+    /* index items to check stability later */
+    for (int i = 0; i < total; i ++)
+        items[i].idx = i;
+
+    * n_items = total;
+    return items;
+}
+
+#define MAX_RUNS 1024
+
+/* The run lengths of the counterexample to TimSort's invariant given by
+ * de Gouw et al. (2015), mirrored for a right-to-left scan, and repeated at
+ * increasing scales.  Returns the number of runs. */
+int runs_timsort_breaking (int * lengths, int n_items)
+{
+    static const int pattern[] = {120, 80, 25, 20, 30};
+    int n_runs = 0;
+
+    /* generated right-to-left, then reversed */
+    for (int scale = 1, total = 0; total < n_items; scale = scale * 3 / 2 + 1)
+    {
+        for (int i = 0; i < 5; i ++)
+        {
+            lengths[n_runs ++] = pattern[i] * scale;
+            total += pattern[i] * scale;
+        }
+    }
+
+    for (int i = 0; i < n_runs / 2; i ++)
+    {
+        int temp = lengths[i];
+        lengths[i] = lengths[n_runs - 1 - i];
+        lengths[n_runs - 1 - i] = temp;
+    }
+
+    return n_runs;
+}
+
+/* Fibonacci run lengths, growing either to the left or to the right */
+int runs_fibonacci (int * lengths, int n_items, bool grow_left)
+{
+    int n_runs = 0;
+
+    for (int a = 1, b = 1, total = 0; total < n_items; total += a)
+    {
+        lengths[n_runs ++] = a;
+        int c = a + b;
+        a = b;
+        b = c;
+    }
+
+    if (grow_left)
+    {
+        for (int i = 0; i < n_runs / 2; i ++)
+        {
+            int temp = lengths[i];
+            lengths[i] = lengths[n_runs - 1 - i];
+            lengths[n_runs - 1 - i] = temp;
+        }
+    }
+
+    return n_runs;
+}
+
+/* Blocks of runs that exactly satisfy the invariant (each half the length of
+ * its right-hand neighbor), preceded by a long run that forces a cascade of
+ * 3-way merges down the whole stack. */
+int runs_three_way (int * lengths, int n_items)
+{
+    int n_runs = 0;
+
+    /* generated right-to-left, then reversed */
+    for (int total = 0, depth = 2; total < n_items; depth ++)
+    {
+        for (int i = 0, len = 1 << depth; i < depth; i ++, len /= 2)
+        {
+            lengths[n_runs ++] = len;
+            total += len;
+        }
+
+        lengths[n_runs ++] = (2 << depth) + 1;
+        total += (2 << depth) + 1;
+    }
+
+    for (int i = 0; i < n_runs / 2; i ++)
+    {
+        int temp = lengths[i];
+        lengths[i] = lengths[n_runs - 1 - i];
+        lengths[n_runs - 1 - i] = temp;
+    }
+
+    return n_runs;
+}
+
+/* random run lengths over several orders of magnitude */
+int runs_random (int * lengths, int n_items)
+{
+    int n_runs = 0;
+
+    for (int total = 0; total < n_items && n_runs < MAX_RUNS; total += lengths[n_runs - 1])
+        lengths[n_runs ++] = g_random_int_range (1, 1 + (1 << g_random_int_range (0, 12)));
+
+    return n_runs;
+}
+
 void print_array (const Item * items, int n_items)
 {
     for (int i = 0; i < n_items; i ++)
@@ -85,6 +232,35 @@ int compare_items (const void * a_, const void * b_, void * data)
         return 1;
 }
 
+/* counts calls in the context pointer */
+int compare_items_counted (const void * a, const void * b, void * data)
+{
+    (* (long long *) data) ++;
+    return compare_items (a, b, NULL);
+}
+
+/* Called by mergesort() each time a run is pushed onto the stack.  Checks the
+ * invariant: each run must be no more than half the length of its right-hand
+ * neighbor.  This bounds the depth of the stack by log2 (N) + 1, well within
+ * the fixed 64 entries. */
+static int max_stack_depth;
+
+void check_stack (void * head, void * const * div, int n_div)
+{
+    if (n_div > 64)
+        abort ();
+
+    for (int i = n_div - 1; i > 0; i --)
+    {
+        char * run_start = (i == n_div - 1) ? head : div[i + 1];
+        if (((char *) div[i] - run_start) > ((char *) div[i - 1] - (char *) div[i]) / 2)
+            abort ();
+    }
+
+    if (max_stack_depth < n_div)
+        max_stack_depth = n_div;
+}
+
 /* verifies correct ordering as well as stability */
 void verify_sorted (const Item * items, int n_items)
 {
@@ -97,10 +273,438 @@ void verify_sorted (const Item * items, int n_items)
     }
 }
 
+/* type-specialized version with the comparison inlined */
+MERGESORT_DEFINE (sort_items, Item, a->val < b->val)
+
+/* the same, counting comparisons */
+static long long n_typed_compares;
+MERGESORT_DEFINE (sort_items_counted, Item, (n_typed_compares ++, a->val < b->val))
+
+/* sorts an adversarial input, checking the number of comparisons against
+ * c * N * log2 (N) and the depth of the run stack against log2 (N) + 1, with
+ * both mergesort() and MERGESORT_DEFINE */
+void check_adversarial (const int * lengths, int n_runs)
+{
+    int n_items;
+    Item * items = gen_runs (lengths, n_runs, & n_items);
+    Item * copy = g_new (Item, n_items);
+    long long n_compares = 0;
+
+    memcpy (copy, items, n_items * sizeof (Item));
+
+    max_stack_depth = 0;
+    mergesort (items, n_items, sizeof (Item), compare_items_counted, & n_compares);
+    verify_sorted (items, n_items);
+    g_free (items);
+
+    if (n_items > 1 && n_compares > 2 * n_items * log2 (n_items))
+        abort ();
+    if (max_stack_depth > (int) log2 (n_items) + 1)
+        abort ();
+
+    max_stack_depth = 0;
+    n_typed_compares = 0;
+    sort_items_counted (copy, n_items);
+    verify_sorted (copy, n_items);
+    g_free (copy);
+
+    if (n_items > 1 && n_typed_compares > 2 * n_items * log2 (n_items))
+        abort ();
+#ifndef MERGESORT_CPP_ENGINE
+    /* the same engine as mergesort(), so exactly the same comparisons */
+    if (n_typed_compares != n_compares)
+        abort ();
+#endif
+    if (max_stack_depth > (int) log2 (n_items) + 1)
+        abort ();
+}
+
+/* allocator callbacks counting live blocks; the context is the counter */
+static void * counted_realloc (void * ptr, size_t size, void * context)
+{
+    if (! ptr)
+        (* (int *) context) ++;
+
+    return g_realloc (ptr, size);
+}
+
+static void counted_free (void * ptr, void * context)
+{
+    (* (int *) context) --;
+    g_free (ptr);
+}
+
+/* sorts through a custom allocator, which must see every block freed */
+void check_allocator (int n_items)
+{
+    int n_blocks = 0;
+    MergeSortAllocator allocator = {counted_realloc, counted_free, & n_blocks};
+
+    Item * items = gen_array (n_items, n_items, false);
+    mergesort_with_allocator (items, n_items, sizeof (Item), compare_items,
+                              NULL, & allocator);
+    verify_sorted (items, n_items);
+    g_free (items);
+
+    if (n_blocks != 0)
+        abort ();
+}
+
+/* padded to take the generic (non-word-sized) code paths */
+typedef struct {
+    Item item;
+    int pad;
+} WideItem;
+
+/* large enough to be sorted indirectly, through an array of pointers */
+typedef struct {
+    Item item;
+    int payload[62];
+} LargeItem;
+
+void check_indirect (int n_items, bool rev)
+{
+    Item * items = gen_array (n_items, n_items / 8, rev);
+    LargeItem * large = g_new (LargeItem, n_items);
+
+    for (int i = 0; i < n_items; i ++)
+    {
+        large[i].item = items[i];
+        for (int j = 0; j < 62; j ++)
+            large[i].payload[j] = items[i].idx + j;
+    }
+
+    LargeItem * by_key = g_new (LargeItem, n_items);
+    memcpy (by_key, large, n_items * sizeof (LargeItem));
+
+    mergesort (large, n_items, sizeof (LargeItem), compare_items, NULL);
+    mergesort_by_key (by_key, n_items, sizeof (LargeItem),
+                      offsetof (LargeItem, item.val), MERGESORT_KEY_I32, false);
+
+    if (memcmp (large, by_key, n_items * sizeof (LargeItem)))
+        abort ();
+
+    /* each record must have been moved as a whole */
+    for (int i = 0; i < n_items; i ++)
+    {
+        items[i] = large[i].item;
+        for (int j = 0; j < 62; j ++)
+            if (large[i].payload[j] != items[i].idx + j)
+                abort ();
+    }
+
+    verify_sorted (items, n_items);
+    g_free (by_key);
+    g_free (large);
+    g_free (items);
+}
+
+/* Elements of the given size in bytes, made of an Item followed by payload
+ * bytes derived from the index, so that moves of only part of an element are
+ * detected.  The patterns are random, sorted, reversed, and random with many
+ * duplicates. */
+enum {PATTERN_RANDOM, PATTERN_SORTED, PATTERN_REVERSED, PATTERN_FEW_UNIQUE, N_PATTERNS};
+
+void check_item_size (int n_items, size_t size, int pattern)
+{
+    char * elems = g_malloc (n_items * size);
+    Item * items = g_new (Item, n_items);
+
+    for (int i = 0; i < n_items; i ++)
+    {
+        char * elem = elems + i * size;
+        Item item = {0, i};
+
+        switch (pattern)
+        {
+        case PATTERN_RANDOM: item.val = g_random_int_range (0, n_items); break;
+        case PATTERN_SORTED: item.val = i; break;
+        case PATTERN_REVERSED: item.val = n_items - i; break;
+        default: item.val = g_random_int_range (0, 4); break;
+        }
+
+        memcpy (elem, & item, sizeof item);
+        for (size_t j = sizeof item; j < size; j ++)
+            elem[j] = (char) (i + j);
+    }
+
+    mergesort64 (elems, n_items, size, compare_items, NULL);
+
+    for (int i = 0; i < n_items; i ++)
+    {
+        char * elem = elems + i * size;
+
+        memcpy (& items[i], elem, sizeof (Item));
+        for (size_t j = sizeof (Item); j < size; j ++)
+            if (elem[j] != (char) (items[i].idx + j))
+                abort ();
+    }
+
+    verify_sorted (items, n_items);
+    g_free (items);
+    g_free (elems);
+}
+
+/* Scratch space beyond the given size must be left alone */
+void check_scratch (const char * scratch, size_t bytes, size_t full)
+{
+    for (size_t i = bytes; i < full; i ++)
+        if (scratch[i] != 0x5a)
+            abort ();
+}
+
+/* sorts with various sizes of caller-supplied scratch buffer, down to none */
+void check_buffer (int n_items, bool rev)
+{
+    size_t full = mergesort_scratch_size (n_items, sizeof (LargeItem));
+    char * scratch = g_malloc (full + 1);
+    WideItem * wide = g_new (WideItem, n_items);
+    LargeItem * large = g_new (LargeItem, n_items);
+
+    for (size_t bytes = full; ; bytes /= 4)
+    {
+        Item * items = gen_array (n_items, n_items / 8, rev);
+
+        for (int i = 0; i < n_items; i ++)
+        {
+            wide[i].item = items[i];
+            large[i].item = items[i];
+            for (int j = 0; j < 62; j ++)
+                large[i].payload[j] = items[i].idx + j;
+        }
+
+        memset (scratch, 0x5a, full + 1);
+
+        mergesort_with_buffer (items, n_items, sizeof (Item), compare_items,
+                               NULL, scratch, bytes);
+        verify_sorted (items, n_items);
+
+        mergesort_with_buffer (wide, n_items, sizeof (WideItem), compare_items,
+                               NULL, scratch, bytes);
+        check_scratch (scratch, bytes, full + 1);
+
+        for (int i = 0; i < n_items; i ++)
+            items[i] = wide[i].item;
+
+        verify_sorted (items, n_items);
+
+        mergesort_with_buffer (large, n_items, sizeof (LargeItem), compare_items,
+                               NULL, scratch, bytes);
+        check_scratch (scratch, bytes, full + 1);
+
+        for (int i = 0; i < n_items; i ++)
+        {
+            items[i] = large[i].item;
+            for (int j = 0; j < 62; j ++)
+                if (large[i].payload[j] != items[i].idx + j)
+                    abort ();
+        }
+
+        verify_sorted (items, n_items);
+        g_free (items);
+
+        if (! bytes)
+            break;
+    }
+
+    g_free (large);
+    g_free (wide);
+    g_free (scratch);
+}
+
+int compare_never (const void * a, const void * b, void * data)
+{
+    abort ();
+}
+
+/* a list of zero-size elements is already sorted, whatever its length, and
+ * must be left alone by every entry point */
+void check_empty_elements (void)
+{
+    char dummy = 0;
+
+    mergesort (& dummy, 1000, 0, compare_never, NULL);
+    mergesort64 (& dummy, 1000, 0, compare_never, NULL);
+    mergesort_with_allocator (& dummy, 1000, 0, compare_never, NULL, NULL);
+    mergesort_with_buffer (& dummy, 1000, 0, compare_never, NULL, NULL, 0);
+    mergesort_parallel (& dummy, 1 << 20, 0, compare_never, NULL, 4);
+    mergesort_by_key (& dummy, 1000, 0, 0, MERGESORT_KEY_BYTES (1), false);
+
+    if (mergesort_scratch_size (1000, 0) != 0)
+        abort ();
+}
+
+/* sorts on several threads; odd thread counts leave unpaired runs */
+void check_parallel (int n_items, int n_threads)
+{
+    Item * items = gen_array (n_items, n_items / 8, false);
+    mergesort_parallel (items, n_items, sizeof (Item), compare_items, NULL, n_threads);
+    verify_sorted (items, n_items);
+    g_free (items);
+
+    WideItem * wide = g_new (WideItem, n_items);
+    items = gen_array (n_items, n_items, true);
+
+    for (int i = 0; i < n_items; i ++)
+        wide[i].item = items[i];
+
+    mergesort_parallel (wide, n_items, sizeof (WideItem), compare_items, NULL, n_threads);
+
+    for (int i = 0; i < n_items; i ++)
+        items[i] = wide[i].item;
+
+    verify_sorted (items, n_items);
+    g_free (items);
+    g_free (wide);
+}
+
+/* sorts by key, checking the result against mergesort() with an equivalent
+ * comparison function */
+typedef struct {
+    int key_type;
+    int descending;
+} KeyOrder;
+
+typedef struct {
+    unsigned char key[12];
+    int idx;
+} KeyedItem;
+
+int compare_keyed (const void * a_, const void * b_, void * data)
+{
+    const KeyedItem * a = a_;
+    const KeyedItem * b = b_;
+    const KeyOrder * order = data;
+    int diff;
+
+#define CMP(type) do { \
+        type x, y; \
+        memcpy (& x, a->key, sizeof x); \
+        memcpy (& y, b->key, sizeof y); \
+        diff = (x > y) - (x < y); \
+    } while (0)
+
+    switch (order->key_type)
+    {
+    case MERGESORT_KEY_U32: CMP (uint32_t); break;
+    case MERGESORT_KEY_I32: CMP (int32_t); break;
+    case MERGESORT_KEY_U64: CMP (uint64_t); break;
+    case MERGESORT_KEY_I64: CMP (int64_t); break;
+    case MERGESORT_KEY_F32: CMP (float); break;
+    case MERGESORT_KEY_F64: CMP (double); break;
+    default: diff = memcmp (a->key, b->key, order->key_type - MERGESORT_KEY_BYTES (0)); break;
+    }
+
+#undef CMP
+
+    return order->descending ? -diff : diff;
+}
+
+void check_by_key (int n_items, int key_type, int descending)
+{
+    KeyedItem * items = g_new0 (KeyedItem, n_items);
+    KeyedItem * expect = g_new0 (KeyedItem, n_items);
+    KeyOrder order = {key_type, descending};
+
+    for (int i = 0; i < n_items; i ++)
+    {
+        /* few distinct values, of both signs */
+        int val = g_random_int_range (-n_items / 4, n_items / 4 + 1);
+        float f = val / 4.0f;
+        double d = val / 4.0;
+        int64_t l = val * INT64_C (0x100000000) + g_random_int_range (0, 4);
+
+        switch (key_type)
+        {
+        case MERGESORT_KEY_F32: memcpy (items[i].key, & f, sizeof f); break;
+        case MERGESORT_KEY_F64: memcpy (items[i].key, & d, sizeof d); break;
+        case MERGESORT_KEY_U64:
+        case MERGESORT_KEY_I64: memcpy (items[i].key, & l, sizeof l); break;
+        default: memcpy (items[i].key, & val, sizeof val); break;
+        }
+
+        items[i].idx = i;
+    }
+
+    memcpy (expect, items, n_items * sizeof (KeyedItem));
+    mergesort (expect, n_items, sizeof (KeyedItem), compare_keyed, & order);
+    mergesort_by_key (items, n_items, sizeof (KeyedItem),
+                      offsetof (KeyedItem, key), key_type, descending);
+
+    if (memcmp (items, expect, n_items * sizeof (KeyedItem)))
+        abort ();
+
+    g_free (items);
+    g_free (expect);
+}
+
 int main (void)
 {
     g_random_set_seed (0);
 
+    check_empty_elements ();
+
+    for (int n_items = 1; n_items < (1 << 20); n_items *= 4)
+    {
+        int lengths[MAX_RUNS];
+        int n_runs;
+
+        n_runs = runs_timsort_breaking (lengths, n_items);
+        check_adversarial (lengths, n_runs);
+        n_runs = runs_fibonacci (lengths, n_items, false);
+        check_adversarial (lengths, n_runs);
+        n_runs = runs_fibonacci (lengths, n_items, true);
+        check_adversarial (lengths, n_runs);
+        n_runs = runs_three_way (lengths, n_items);
+        check_adversarial (lengths, n_runs);
+        n_runs = runs_random (lengths, n_items);
+        check_adversarial (lengths, n_runs);
+    }
+
+    for (int n_items = 1; n_items < (1 << 20); n_items *= 3)
+    {
+        check_parallel (n_items, 0);
+        check_parallel (n_items, 3);
+        check_parallel (n_items, 5);
+        check_parallel (n_items, 8);
+    }
+
+    static const int key_types[] = {
+        MERGESORT_KEY_U32, MERGESORT_KEY_I32, MERGESORT_KEY_U64,
+        MERGESORT_KEY_I64, MERGESORT_KEY_F32, MERGESORT_KEY_F64,
+        MERGESORT_KEY_BYTES (3), MERGESORT_KEY_BYTES (12)
+    };
+
+    for (int n_items = 1; n_items < 65536; n_items *= 4)
+    {
+        for (int k = 0; k < (int) G_N_ELEMENTS (key_types); k ++)
+        {
+            check_by_key (n_items, key_types[k], false);
+            check_by_key (n_items, key_types[k], true);
+        }
+    }
+
+    /* every size with its own copy loops, and sizes next to them */
+    static const size_t item_sizes[] = {8, 12, 16, 20, 24, 32, 40, 64, 72, 128, 132};
+
+    for (int n_items = 1; n_items < 65536; n_items *= 4)
+    {
+        for (int s = 0; s < (int) G_N_ELEMENTS (item_sizes); s ++)
+        {
+            for (int pattern = 0; pattern < N_PATTERNS; pattern ++)
+                check_item_size (n_items, item_sizes[s], pattern);
+        }
+    }
+
+    for (int n_items = 1; n_items < 65536; n_items *= 4)
+    {
+        check_allocator (n_items);
+        check_buffer (n_items, false);
+        check_buffer (n_items, true);
+        check_indirect (n_items, false);
+        check_indirect (n_items, true);
+    }
+
     for (int n_items = 1; n_items < 65536; n_items *= 2)
     {
         for (int n_swaps = 1; n_swaps < n_items; n_swaps *= 2)
@@ -126,6 +730,21 @@ int main (void)
             mergesort (items, n_items, sizeof (Item), compare_items, NULL);
             verify_sorted (items, n_items);
             g_free (items);
+
+            items = gen_array (n_items, n_swaps, true);
+            mergesort64 (items, n_items, sizeof (Item), compare_items, NULL);
+            verify_sorted (items, n_items);
+            g_free (items);
+
+            items = gen_array (n_items, n_swaps, false);
+            sort_items (items, n_items);
+            verify_sorted (items, n_items);
+            g_free (items);
+
+            items = gen_array (n_items, n_swaps, true);
+            sort_items (items, n_items);
+            verify_sorted (items, n_items);
+            g_free (items);
         }
     }
 